@@ -0,0 +1,456 @@
+// Per-stage microbenchmarks of the encoder's hot functions. The encoder is
+// built into this file so its static kernels can be timed on their own:
+//
+//     gcc -O2 -pthread bench.c huffman.c -o bench -ljpeg -lm
+//     ./bench [--size=WxH] [--quality=Q] [--min-time=MS] [image.jpg|image.ppm]
+//
+// Every stage runs over all blocks of a noise image, a smooth gradient
+// image and the given image, if any, each fed with the previous stage's
+// output. Stages with SIMD kernels run once for every kernel set the CPU
+// supports, named in the variant column; the set the encoder itself would
+// use, after JPEG_SIMD, is printed on stderr. Results are CSV on stdout, one
+// line per stage, variant and input, with the best of the timed runs:
+//
+//     stage,variant,input,unit,items,ns_per_item,mb_per_s
+//
+// An item is one 8x8 block (of luma samples, or their coefficients), or
+// one call for write_bits. MB/s counts the bytes each stage consumes: RGB
+// pixels, samples, int16 coefficients, or the bits written.
+#include <time.h>
+
+#define JPEG_NO_MAIN
+#include "jpeg_compress.c"
+
+#define BENCH_MIN_RUNS 3
+#define BENCH_CODES_PER_BLOCK 16 // write_bits calls per block, about what a q75 block emits
+
+typedef struct
+{
+    const char *name;
+    uint32_t width, height; // Multiples of 16
+    size_t blocks;          // 8x8 blocks of one full-resolution plane
+    uint8_t *rgb;           // Packed RGB24
+    uint8_t *planes[3];     // Y, Cb and Cr at full resolution
+    uint8_t *chroma;        // Cb downsampled
+    uint8_t *samples;       // Luma blocks, 64 samples each
+    int16_t *coefs;         // DCT of samples, natural order, scaled by 8
+    int16_t *zigzag;        // Quantized coefficients in zigzag order
+    uint32_t *codes;        // write_bits arguments: bits << 5 | count
+    size_t code_bits;       // Bits in codes
+} BenchInput;
+
+typedef struct
+{
+    const char *stage;
+    const char *variant; // NULL: one line for each kernel set with its own kernel
+    const char *unit;
+    // Run the stage once over the input with state's kernels and DCT
+    // method; returns the items processed and sets the bytes consumed
+    size_t (*run)(BenchInput *input, const JpegState *state, size_t *bytes);
+    size_t kernel;         // Offset of the stage's kernel in JpegKernels
+    DctMethod dct_method;
+} BenchCase;
+
+// Keeps the results of every run observable
+static volatile uint32_t bench_sink;
+
+static size_t run_color(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    const size_t pixels = (size_t)input->width * input->height;
+    for (uint32_t y = 0; y < input->height; y++)
+    {
+        const size_t offset = (size_t)y * input->width;
+        state->kernels->rgb_to_ycbcr_row(input->rgb + 3 * offset, input->planes[0] + offset,
+                                         input->planes[1] + offset, input->planes[2] + offset, input->width);
+    }
+    bench_sink += input->planes[0][pixels - 1];
+    *bytes = 3 * pixels;
+    return input->blocks;
+}
+
+static size_t run_h2v2(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    const uint32_t width = input->width;
+    for (uint32_t y = 0; y < input->height; y += 2)
+    {
+        const uint8_t *row = input->planes[1] + (size_t)y * width;
+        state->kernels->downsample_h2v2(row, row + width, input->chroma + (size_t)(y / 2) * (width / 2), width / 2);
+    }
+    bench_sink += input->chroma[0];
+    *bytes = (size_t)width * input->height;
+    return input->blocks;
+}
+
+static size_t run_h2v1(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    const uint32_t width = input->width;
+    for (uint32_t y = 0; y < input->height; y++)
+    {
+        state->kernels->downsample_h2v1(input->planes[1] + (size_t)y * width,
+                                        input->chroma + (size_t)y * (width / 2), width / 2);
+    }
+    bench_sink += input->chroma[0];
+    *bytes = (size_t)width * input->height;
+    return input->blocks;
+}
+
+// All DCT methods go through forward_dct_blocks as the encoder calls them
+static size_t run_forward_dct(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    forward_dct_blocks(state, input->samples, input->coefs, input->blocks);
+    bench_sink += (uint16_t)input->coefs[0];
+    *bytes = input->blocks * BLOCK_SIZE * BLOCK_SIZE;
+    return input->blocks;
+}
+
+static size_t run_quantize_zigzag(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    const size_t n = BLOCK_SIZE * BLOCK_SIZE;
+    for (size_t b = 0; b < input->blocks; b++)
+    {
+        state->kernels->quantize_zigzag(input->coefs + b * n, &state->divisors_y, input->zigzag + b * n);
+    }
+    bench_sink += (uint16_t)input->zigzag[0];
+    *bytes = input->blocks * n * sizeof(int16_t);
+    return input->blocks;
+}
+
+static size_t run_count_symbols(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    (void)state;
+    const size_t n = BLOCK_SIZE * BLOCK_SIZE;
+    uint32_t dc_freq[256] = {0}, ac_freq[256] = {0};
+    int16_t last_dc = 0;
+    for (size_t b = 0; b < input->blocks; b++)
+    {
+        count_block_symbols(input->zigzag + b * n, &last_dc, dc_freq, ac_freq);
+    }
+    bench_sink += ac_freq[0];
+    *bytes = input->blocks * n * sizeof(int16_t);
+    return input->blocks;
+}
+
+static size_t run_huffman_encode(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    const size_t n = BLOCK_SIZE * BLOCK_SIZE;
+    uint8_t buffer[OUTPUT_BUFFER_SIZE];
+    size_t written = 0;
+    JpegWriter writer;
+    init_writer(&writer, (JpegSink){count_sink_write, &written}, buffer, sizeof(buffer));
+
+    for (size_t b = 0; b < input->blocks; b++)
+    {
+        huffman_encode_block(&writer, input->zigzag + b * n, &writer.last_dc[0], &state->dc_table_y,
+                             &state->ac_table_y);
+    }
+    flush_bits(&writer);
+    flush_output(&writer);
+    bench_sink += (uint32_t)written;
+    *bytes = input->blocks * n * sizeof(int16_t);
+    return input->blocks;
+}
+
+static size_t run_write_bits(BenchInput *input, const JpegState *state, size_t *bytes)
+{
+    (void)state;
+    const size_t count = input->blocks * BENCH_CODES_PER_BLOCK;
+    uint8_t buffer[OUTPUT_BUFFER_SIZE];
+    size_t written = 0;
+    JpegWriter writer;
+    init_writer(&writer, (JpegSink){count_sink_write, &written}, buffer, sizeof(buffer));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        write_bits(&writer, input->codes[i] >> 5, (int)(input->codes[i] & 31));
+    }
+    flush_bits(&writer);
+    flush_output(&writer);
+    bench_sink += (uint32_t)written;
+    *bytes = input->code_bits / 8;
+    return count;
+}
+
+// Cases run in this order over each input. The floating-point DCTs come
+// before the integer one, whose coefficients quantization then sees.
+static const BenchCase BENCH_CASES[] = {
+    {"rgb_to_ycbcr_row", NULL, "block", run_color, offsetof(JpegKernels, rgb_to_ycbcr_row), DCT_INT},
+    {"downsample_h2v2", NULL, "block", run_h2v2, offsetof(JpegKernels, downsample_h2v2), DCT_INT},
+    {"downsample_h2v1", NULL, "block", run_h2v1, offsetof(JpegKernels, downsample_h2v1), DCT_INT},
+    {"forward_dct", "fast", "block", run_forward_dct, 0, DCT_FAST},
+    {"forward_dct", "float", "block", run_forward_dct, 0, DCT_FAST_FLOAT},
+    {"fdct_islow", NULL, "block", run_forward_dct, offsetof(JpegKernels, fdct_islow), DCT_INT},
+    {"quantize_zigzag", NULL, "block", run_quantize_zigzag, offsetof(JpegKernels, quantize_zigzag), DCT_INT},
+    {"count_block_symbols", "scalar", "block", run_count_symbols, 0, DCT_INT},
+    {"huffman_encode_block", "scalar", "block", run_huffman_encode, 0, DCT_INT},
+    {"write_bits", "scalar", "call", run_write_bits, 0, DCT_INT},
+};
+
+// Whether kernel set k runs the same kernel for this case as set k - 1
+static int reuses_kernel(const BenchCase *bench, int k)
+{
+    const char *set = (const char *)&KERNELS[k];
+    return k > 0 && memcmp(set + bench->kernel, set - sizeof(JpegKernels) + bench->kernel,
+                           sizeof(void (*)(void))) == 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Best time of at least BENCH_MIN_RUNS runs lasting min_time in total
+static double time_case(const BenchCase *bench, BenchInput *input, const JpegState *state, double min_time,
+                        size_t *items, size_t *bytes)
+{
+    double best = INFINITY, total = 0.0;
+    for (int runs = 0; runs < BENCH_MIN_RUNS || total < min_time; runs++)
+    {
+        const double start = now_seconds();
+        *items = bench->run(input, state, bytes);
+        const double elapsed = now_seconds() - start;
+        total += elapsed;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static uint32_t bench_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 8;
+}
+
+static int alloc_input(BenchInput *input, const char *name, uint32_t width, uint32_t height)
+{
+    memset(input, 0, sizeof(*input));
+    input->name = name;
+    input->width = width & ~15u;
+    input->height = height & ~15u;
+    if (input->width == 0 || input->height == 0)
+        return -1;
+
+    const size_t pixels = (size_t)input->width * input->height;
+    input->blocks = pixels / (BLOCK_SIZE * BLOCK_SIZE);
+    input->rgb = malloc(3 * pixels);
+    for (int c = 0; c < 3; c++)
+    {
+        input->planes[c] = malloc(pixels);
+    }
+    input->chroma = malloc(pixels / 2);
+    input->samples = malloc(pixels);
+    input->coefs = malloc(pixels * sizeof(int16_t));
+    input->zigzag = malloc(pixels * sizeof(int16_t));
+    input->codes = malloc(input->blocks * BENCH_CODES_PER_BLOCK * sizeof(uint32_t));
+    return input->rgb && input->planes[0] && input->planes[1] && input->planes[2] && input->chroma &&
+                   input->samples && input->coefs && input->zigzag && input->codes
+               ? 0
+               : -1;
+}
+
+static void free_input(BenchInput *input)
+{
+    free(input->rgb);
+    for (int c = 0; c < 3; c++)
+    {
+        free(input->planes[c]);
+    }
+    free(input->chroma);
+    free(input->samples);
+    free(input->coefs);
+    free(input->zigzag);
+    free(input->codes);
+}
+
+// Run the encoder's own kernels once over the pixels so every stage gets
+// the data it would see in an encode
+static void prepare_input(BenchInput *input, const JpegState *state)
+{
+    size_t bytes;
+    run_color(input, state, &bytes);
+
+    uint8_t *block = input->samples;
+    for (uint32_t y = 0; y < input->height; y += BLOCK_SIZE)
+    {
+        for (uint32_t x = 0; x < input->width; x += BLOCK_SIZE, block += BLOCK_SIZE * BLOCK_SIZE)
+        {
+            extract_block(input->planes[0], input->width, x, y, block);
+        }
+    }
+    run_forward_dct(input, state, &bytes);
+    run_quantize_zigzag(input, state, &bytes);
+
+    // Codes of 1 to 27 bits, the range emit_symbol passes
+    uint32_t seed = 1;
+    for (size_t i = 0; i < input->blocks * BENCH_CODES_PER_BLOCK; i++)
+    {
+        const uint32_t count = 1 + bench_random(&seed) % 27;
+        input->codes[i] = (bench_random(&seed) & ((1u << count) - 1)) << 5 | count;
+        input->code_bits += count;
+    }
+}
+
+static void fill_noise(BenchInput *input)
+{
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < 3 * (size_t)input->width * input->height; i++)
+    {
+        input->rgb[i] = (uint8_t)bench_random(&seed);
+    }
+}
+
+static void fill_smooth(BenchInput *input)
+{
+    uint8_t *out = input->rgb;
+    for (uint32_t y = 0; y < input->height; y++)
+    {
+        for (uint32_t x = 0; x < input->width; x++, out += 3)
+        {
+            out[0] = (uint8_t)(255 * x / input->width);
+            out[1] = (uint8_t)(255 * y / input->height);
+            out[2] = (uint8_t)(255 * (x + y) / (input->width + input->height));
+        }
+    }
+}
+
+// Decode a JPEG or PNM file with the encoder's readers and keep its pixels,
+// cropped to whole 16x16 blocks
+static int load_image(BenchInput *input, const char *filename, uint8_t quality)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return -1;
+    const int magic = fgetc(file);
+    fclose(file);
+
+    JpegState *image = jpeg_init(1, 1, quality);
+    if (!image)
+        return -1;
+    size_t size = 0;
+    const JpegSink counter = {count_sink_write, &size};
+    int result = magic == 'P' ? read_pnm(filename, image, counter) : read_jpeg(filename, image, counter);
+    if (result == 0)
+        result = alloc_input(input, filename, image->width, image->height);
+    if (result == 0)
+    {
+        for (uint32_t y = 0; y < input->height; y++)
+        {
+            memcpy(input->rgb + (size_t)y * input->width * 3, &image->rgb_data[(size_t)y * image->width],
+                   (size_t)input->width * 3);
+        }
+    }
+    jpeg_cleanup(image);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t width = 1024, height = 1024;
+    int quality = 75;
+    double min_time = 0.25;
+    const char *image_filename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--size=", 7) == 0)
+        {
+            if (sscanf(argv[i] + 7, "%ux%u", &width, &height) != 2 || width < 16 || height < 16)
+            {
+                fprintf(stderr, "Error: Synthetic images are at least 16x16\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--quality=", 10) == 0)
+        {
+            quality = atoi(argv[i] + 10);
+            if (quality < 1 || quality > 100)
+            {
+                fprintf(stderr, "Error: Quality must be 1-100\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--min-time=", 11) == 0)
+        {
+            min_time = atoi(argv[i] + 11) / 1000.0;
+        }
+        else if (argv[i][0] != '-' && !image_filename)
+        {
+            image_filename = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--size=WxH] [--quality=Q] [--min-time=MS] [image.jpg|image.ppm]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Quantization and Huffman tables at the benchmark quality
+    JpegState *state = jpeg_init(1, 1, (uint8_t)quality);
+    if (!state)
+    {
+        fprintf(stderr, "Error: Failed to initialize JPEG state\n");
+        return EXIT_FAILURE;
+    }
+
+    BenchInput inputs[3] = {0};
+    int input_count = 0;
+    int status = EXIT_FAILURE;
+    if (alloc_input(&inputs[0], "noise", width, height) != 0 || alloc_input(&inputs[1], "smooth", width, height) != 0)
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto cleanup;
+    }
+    fill_noise(&inputs[0]);
+    fill_smooth(&inputs[1]);
+    input_count = 2;
+    if (image_filename)
+    {
+        if (load_image(&inputs[2], image_filename, (uint8_t)quality) != 0)
+        {
+            fprintf(stderr, "Error: Cannot read %s, or it is smaller than 16x16\n", image_filename);
+            goto cleanup;
+        }
+        input_count = 3;
+    }
+
+    const int kernel_count = supported_kernel_count();
+    fprintf(stderr, "Kernels: %s (of %d supported)\n", state->kernels->name, kernel_count);
+    printf("stage,variant,input,unit,items,ns_per_item,mb_per_s\n");
+    for (int i = 0; i < input_count; i++)
+    {
+        prepare_input(&inputs[i], state);
+        for (size_t c = 0; c < sizeof(BENCH_CASES) / sizeof(BENCH_CASES[0]); c++)
+        {
+            const BenchCase *bench = &BENCH_CASES[c];
+            for (int k = 0; k < kernel_count; k++)
+            {
+                // Cases without their own kernels run once, with the
+                // encoder's selection
+                if (bench->variant ? k > 0 : reuses_kernel(bench, k))
+                    continue;
+
+                JpegState run_state = *state;
+                run_state.kernels = bench->variant ? state->kernels : &KERNELS[k];
+                run_state.dct_method = bench->dct_method;
+                size_t items, bytes;
+                const double seconds = time_case(bench, &inputs[i], &run_state, min_time, &items, &bytes);
+                printf("%s,%s,%s,%s,%zu,%.2f,%.1f\n", bench->stage,
+                       bench->variant ? bench->variant : KERNELS[k].name, inputs[i].name, bench->unit, items,
+                       seconds * 1e9 / items, bytes / seconds / 1e6);
+                fflush(stdout);
+            }
+        }
+    }
+    status = EXIT_SUCCESS;
+
+cleanup:
+    for (int i = 0; i < 3; i++)
+    {
+        free_input(&inputs[i]);
+    }
+    jpeg_cleanup(state);
+    return status;
+}
@@ -1,164 +1,160 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <jpeg_common.h>
+#include <stdint.h>
+#include "jpeg_common.h"
 
-#define MAX_SYMBOLS 256
-#define MAX_TREE_NODES (MAX_SYMBOLS * 2 - 1)
+// Optimal Huffman tables for the encoder's optimize mode. The tree is
+// built with a binary min-heap, code lengths are then limited to the 16
+// bits JPEG allows (Annex K.2), and the result is written in canonical
+// form as the BITS/VALUES arrays of a DHT table.
+
+#define MAX_SYMBOLS 257 // 256 byte symbols plus a reserved pseudo-symbol
+#define MAX_NODES (2 * MAX_SYMBOLS - 1)
+#define MAX_TREE_DEPTH MAX_SYMBOLS
 
-// The Huffman tree node structure
-typedef struct HuffmanNode
-{
-    int symbol;    // Original symbol (or -1 for internal nodes)
-    int frequency; // Frequency of the symbol
-    int left;      // Index of left child
-    int right;     // Index of right child
-    char *code;    // Huffman code for the symbol
-} HuffmanNode;
-
-// The structure to store symbol frequencies
 typedef struct
 {
-    int symbol;
-    int frequency;
-} SymbolFreq;
+    const uint32_t *weight; // Weight of every node
+    int nodes[MAX_SYMBOLS]; // Node indices, ordered as a min-heap
+    int size;
+} NodeHeap;
+
+// Order by weight; ties go to the higher node index, as in libjpeg, which
+// keeps the pseudo-symbol at the deepest level and the result deterministic
+static int node_less(const NodeHeap *heap, int a, int b)
+{
+    if (heap->weight[a] != heap->weight[b])
+        return heap->weight[a] < heap->weight[b];
+    return a > b;
+}
 
-// Compare function for qsort
-int compare_frequencies(const void *a, const void *b)
+static void heap_push(NodeHeap *heap, int node)
 {
-    return ((SymbolFreq *)a)->frequency - ((SymbolFreq *)b)->frequency;
+    int i = heap->size++;
+    while (i > 0)
+    {
+        const int parent = (i - 1) / 2;
+        if (!node_less(heap, node, heap->nodes[parent]))
+            break;
+        heap->nodes[i] = heap->nodes[parent];
+        i = parent;
+    }
+    heap->nodes[i] = node;
 }
 
-// Build the Huffman tree from RLE codes
-HuffmanNode *build_huffman_tree(RLECode *rle_data, int code_count)
+static int heap_pop(NodeHeap *heap)
 {
-    // Count frequencies of (run_length, value) pairs
-    SymbolFreq frequencies[MAX_SYMBOLS] = {0};
-    int unique_symbols = 0;
+    const int top = heap->nodes[0];
+    const int last = heap->nodes[--heap->size];
+    int i = 0;
 
-    // Count frequencies of RLE codes
-    for (int i = 0; i < code_count; i++)
+    for (;;)
     {
-        // Create a unique symbol from run_length and value
-        // We'll use upper 8 bits for run_length and lower 8 bits for value
-        int symbol = (rle_data[i].run_length << 8) | (abs(rle_data[i].value) & 0xFF);
+        int child = 2 * i + 1;
+        if (child >= heap->size)
+            break;
+        if (child + 1 < heap->size && node_less(heap, heap->nodes[child + 1], heap->nodes[child]))
+            child++;
+        if (!node_less(heap, heap->nodes[child], last))
+            break;
+        heap->nodes[i] = heap->nodes[child];
+        i = child;
+    }
+    heap->nodes[i] = last;
+    return top;
+}
 
-        // Find or add symbol
-        int found = 0;
-        for (int j = 0; j < unique_symbols; j++)
-        {
-            if (frequencies[j].symbol == symbol)
-            {
-                frequencies[j].frequency++;
-                found = 1;
-                break;
-            }
-        }
-        if (!found)
-        {
-            frequencies[unique_symbols].symbol = symbol;
-            frequencies[unique_symbols].frequency = 1;
-            unique_symbols++;
-        }
+// Build a DHT table for symbols 0-255 with the given frequencies. Symbols
+// with zero frequency get no code. A pseudo-symbol of frequency 1 takes
+// the longest code during construction and is dropped afterwards, so no
+// real code consists only of 1 bits. This cannot fail: every table codes
+// at least one symbol, symbol 0 if the histogram is empty.
+void build_huffman_spec(const uint32_t freq[256], HuffmanSpec *spec)
+{
+    uint32_t weight[MAX_NODES];
+    int parent[MAX_NODES];
+    int depth[MAX_NODES];
+    int bits[MAX_TREE_DEPTH + 1] = {0};
+    NodeHeap heap = {weight, {0}, 0};
+
+    // Leaves; an empty histogram still gets a valid one-symbol table
+    int used = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        weight[i] = freq[i];
+        used += freq[i] != 0;
     }
+    if (used == 0)
+        weight[0] = 1;
+    weight[256] = 1;
 
-    // Sort by frequency
-    qsort(frequencies, unique_symbols, sizeof(SymbolFreq), compare_frequencies);
+    for (int i = 0; i < MAX_SYMBOLS; i++)
+    {
+        parent[i] = -1;
+        if (weight[i] > 0)
+            heap_push(&heap, i);
+    }
 
-    // Create tree nodes
-    HuffmanNode *tree = (HuffmanNode *)calloc(MAX_TREE_NODES, sizeof(HuffmanNode));
-    int node_count = 0;
+    // Merge the two lightest nodes until one tree remains. Internal nodes
+    // are appended, so every parent has a higher index than its children.
+    int next = MAX_SYMBOLS;
+    while (heap.size > 1)
+    {
+        const int a = heap_pop(&heap);
+        const int b = heap_pop(&heap);
+        weight[next] = weight[a] + weight[b];
+        parent[next] = -1;
+        parent[a] = parent[b] = next;
+        heap_push(&heap, next++);
+    }
 
-    // Initialize leaf nodes
-    for (int i = 0; i < unique_symbols; i++)
+    // Depths top-down from the root, then count codes of each length
+    for (int i = next - 1; i >= 0; i--)
+    {
+        depth[i] = parent[i] < 0 ? 0 : depth[parent[i]] + 1;
+    }
+    for (int i = 0; i < MAX_SYMBOLS; i++)
     {
-        tree[node_count].symbol = frequencies[i].symbol;
-        tree[node_count].frequency = frequencies[i].frequency;
-        tree[node_count].left = -1;
-        tree[node_count].right = -1;
-        tree[node_count].code = NULL;
-        node_count++;
+        if (weight[i] > 0)
+            bits[depth[i]]++;
     }
 
-    // Build tree by combining nodes
-    while (node_count < unique_symbols * 2 - 1)
+    // Limit lengths to 16 bits (Annex K.3, Figure K.3): take two codes of
+    // the overlong length, move their prefix up a level, and split a
+    // shorter code to make room for the second one
+    for (int i = MAX_TREE_DEPTH; i > 16; i--)
     {
-        // Find two nodes with lowest frequencies
-        int min1 = 0, min2 = 1;
-        for (int i = 2; i < node_count; i++)
+        while (bits[i] > 0)
         {
-            if (tree[i].frequency < tree[min1].frequency)
-            {
-                min2 = min1;
-                min1 = i;
-            }
-            else if (tree[i].frequency < tree[min2].frequency)
-            {
-                min2 = i;
-            }
+            int j = i - 2;
+            while (bits[j] == 0)
+                j--;
+
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
         }
-
-        // Create new internal node
-        tree[node_count].symbol = -1;
-        tree[node_count].frequency = tree[min1].frequency + tree[min2].frequency;
-        tree[node_count].left = min1;
-        tree[node_count].right = min2;
-        tree[node_count].code = NULL;
-        node_count++;
     }
 
-    return tree;
-}
+    // Drop the pseudo-symbol, which holds one of the longest codes
+    int longest = 16;
+    while (bits[longest] == 0)
+        longest--;
+    bits[longest]--;
 
-// Generate Huffman codes recursively
-void generate_huffman_codes(HuffmanNode *tree, int node_index, char *current_code)
-{
-    if (node_index == -1)
-        return;
-
-    // If this is a leaf node, store the code
-    if (tree[node_index].left == -1 && tree[node_index].right == -1)
+    for (int i = 0; i < 16; i++)
     {
-        tree[node_index].code = strdup(current_code);
-        return;
+        spec->bits[i] = (uint8_t)bits[i + 1];
     }
 
-    // Traverse left (add '0')
-    char left_code[256];
-    sprintf(left_code, "%s0", current_code);
-    generate_huffman_codes(tree, tree[node_index].left, left_code);
-
-    // Traverse right (add '1')
-    char right_code[256];
-    sprintf(right_code, "%s1", current_code);
-    generate_huffman_codes(tree, tree[node_index].right, right_code);
-}
-
-// Function to encode RLE data using Huffman coding
-void huffman_encode_rle(RLECode *rle_data, int code_count)
-{
-    // Build Huffman tree
-    HuffmanNode *tree = build_huffman_tree(rle_data, code_count);
-
-    // Generate Huffman codes
-    generate_huffman_codes(tree, code_count * 2 - 2, "");
-
-    // Print Huffman codes for each symbol
-    printf("\nHuffman Codes:\n");
-    for (int i = 0; i < code_count * 2 - 1; i++)
+    // Symbols in order of their unlimited code length; limiting keeps that
+    // order, so this is also the canonical order of the limited codes
+    spec->count = 0;
+    for (int length = 1; length <= MAX_TREE_DEPTH; length++)
     {
-        if (tree[i].symbol != -1 && tree[i].code != NULL)
+        for (int i = 0; i < 256; i++)
         {
-            int run_length = (tree[i].symbol >> 8) & 0xFF;
-            int value = tree[i].symbol & 0xFF;
-            printf("(%d zeros, %d): %s\n", run_length, value, tree[i].code);
+            if (weight[i] > 0 && depth[i] == length)
+                spec->values[spec->count++] = (uint8_t)i;
         }
     }
-
-    // Clean up
-    for (int i = 0; i < code_count * 2 - 1; i++)
-    {
-        free(tree[i].code);
-    }
-    free(tree);
-}
\ No newline at end of file
+}
@@ -9,6 +9,8 @@
 // Constants
 #define BLOCK_SIZE 8
 #define PI 3.14159265358979323846
+#define OUTPUT_BUFFER_SIZE 4096 // Encoded bytes held before they go to the sink
+#define MAX_SCANS 64            // Scans a progressive scan script may hold
 
 // Basic color structures
 typedef struct
@@ -27,36 +29,185 @@ typedef struct
     double data[BLOCK_SIZE][BLOCK_SIZE];
 } DctBlock;
 
+typedef struct
+{
+    float data[BLOCK_SIZE][BLOCK_SIZE];
+} DctBlockF32;
+
+// Forward DCT implementations
+typedef enum
+{
+    DCT_REFERENCE,  // Direct definition with cos() per term, used to check accuracy
+    DCT_FAST,       // Separable AAN transform in double precision
+    DCT_FAST_FLOAT, // Separable AAN transform in single precision
+    DCT_INT         // Fixed-point LLM transform, SIMD over several blocks per call
+} DctMethod;
+
+// Reciprocal form of a quantization table, in zigzag order. Each divisor
+// includes the 8x scale of the DCT output, and quantizing |c| becomes
+// ((|c| + corr) * recip) >> shift, which rounds exactly like a divide.
+// SIMD kernels shift with a second 16-bit multiply by scale instead.
+typedef struct
+{
+    uint16_t recip[BLOCK_SIZE * BLOCK_SIZE];
+    uint16_t corr[BLOCK_SIZE * BLOCK_SIZE];
+    uint16_t scale[BLOCK_SIZE * BLOCK_SIZE]; // 1 << (32 - shift)
+    uint8_t shift[BLOCK_SIZE * BLOCK_SIZE];
+} QuantDivisors;
+
+// The hot kernels for one instruction set, bound by jpeg_init to the
+// widest set the CPU supports (see select_kernels). All sets give
+// bit-identical results.
+typedef struct
+{
+    const char *name; // scalar, sse2, ssse3 or avx2
+    void (*fdct_islow)(const uint8_t *samples, int16_t *coefs, size_t nblocks);
+    void (*rgb_to_ycbcr_row)(const uint8_t *rgb, uint8_t *y, uint8_t *cb, uint8_t *cr, uint32_t width);
+    void (*downsample_h2v2)(const uint8_t *row0, const uint8_t *row1, uint8_t *out, uint32_t out_width);
+    void (*downsample_h2v1)(const uint8_t *row, uint8_t *out, uint32_t out_width);
+    void (*quantize_zigzag)(const int16_t coefs[BLOCK_SIZE * BLOCK_SIZE], const QuantDivisors *div,
+                            int16_t output[BLOCK_SIZE * BLOCK_SIZE]);
+} JpegKernels;
+
 typedef struct
 {
     int16_t value;      // The value of the coefficient
     uint8_t run_length; // Number of zeros before this coefficient
 } RLECode;
 
-// Huffman coding structures
+// Huffman table as stored in DHT: bits[i] is the number of codes of
+// length i + 1 and values lists the symbols in order of code length
 typedef struct
 {
-    uint8_t code_length; // Length of the Huffman code
-    uint16_t code;       // The Huffman code itself
-} HuffmanCode;
+    uint8_t bits[16];
+    uint8_t values[256];
+    int count; // Number of symbols in values
+} HuffmanSpec;
 
+// Huffman table in encoder form, indexed by symbol. Each entry packs the
+// code and its length as (code << 8) | length; unused symbols are 0.
 typedef struct
 {
-    HuffmanCode *codes; // Array of Huffman codes
-    uint16_t count;     // Number of codes
+    uint32_t entries[256];
 } HuffmanTable;
 
+// One scan of a progressive JPEG: the components it codes (0 = Y, 1 = Cb,
+// 2 = Cr, in increasing order), the band ss..se of zigzag positions, and
+// the successive approximation bit positions ah (previous scan) and al
+typedef struct
+{
+    uint8_t component_count;
+    uint8_t components[3];
+    uint8_t ss, se;
+    uint8_t ah, al;
+} JpegScan;
+
 // JPEG markers
 typedef enum
 {
     MARKER_SOI = 0xFFD8,  // Start of Image
     MARKER_EOI = 0xFFD9,  // End of Image
     MARKER_SOF0 = 0xFFC0, // Start of Frame (Baseline DCT)
+    MARKER_SOF2 = 0xFFC2, // Start of Frame (Progressive DCT)
     MARKER_DHT = 0xFFC4,  // Define Huffman Table
     MARKER_DQT = 0xFFDB,  // Define Quantization Table
-    MARKER_SOS = 0xFFDA   // Start of Scan
+    MARKER_SOS = 0xFFDA,  // Start of Scan
+    MARKER_DRI = 0xFFDD,  // Define Restart Interval
+    MARKER_RST0 = 0xFFD0  // Restart markers RST0-RST7
+
 } JpegMarker;
 
+// Destination for the encoded stream. write receives the bytes in order,
+// in chunks of at most OUTPUT_BUFFER_SIZE, and returns 0 on success or
+// nonzero to abort the encode.
+typedef struct
+{
+    int (*write)(void *opaque, const uint8_t *data, size_t size);
+    void *opaque;
+} JpegSink;
+
+// Growable in-memory destination used by jpeg_memory_sink; release data
+// with free()
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} JpegMemoryBuffer;
+
+// One extra output of a quality ladder (see jpeg_set_ladder)
+typedef struct
+{
+    uint8_t quality;
+    JpegSink sink;
+} JpegRung;
+
+// A downscaled copy of the image, encoded alongside the main output
+typedef struct
+{
+    uint8_t scale; // 2, 4 or 8
+    JpegSink sink;
+} JpegPreview;
+
+// Buffered output into a sink together with the entropy coder state.
+// The main stream has one; restart segments encoded on worker threads
+// each get their own.
+typedef struct
+{
+    JpegSink sink;
+    int sink_error;          // Set once the sink fails; later output is dropped
+    uint8_t *buffer;         // OUTPUT_BUFFER_SIZE bytes awaiting the sink
+    uint32_t buffer_size;
+    uint32_t buffer_position;
+
+    // Bit writing state
+    uint64_t bit_buffer;    // Pending bits, right-aligned
+    uint8_t bits_in_buffer; // Number of valid bits in bit_buffer (0-63)
+
+    // DC coefficient tracking
+    int16_t last_dc[3]; // Last DC value for Y, Cb and Cr
+} JpegWriter;
+
+// One MCU-tall strip in planar form, 64-byte aligned and padded to whole
+// MCUs. plane_y is at full resolution; plane_cb/plane_cr hold the same
+// strip at the subsampled size.
+typedef struct
+{
+    uint8_t *plane_y;
+    uint8_t *plane_cb;
+    uint8_t *plane_cr;
+    uint32_t stride_y;
+    uint32_t stride_c;
+    uint8_t *chroma_rows; // Full-resolution Cb/Cr rows awaiting downsampling
+    uint32_t mcu_row;     // MCU row currently converted, UINT32_MAX if none
+} StripBuffers;
+
+// Chroma subsampling of colour images
+typedef enum
+{
+    CHROMA_444, // Full-resolution chroma, 8x8 MCUs
+    CHROMA_422, // Half-width chroma, 16x8 MCUs
+    CHROMA_420  // Half-width, half-height chroma, 16x16 MCUs
+} ChromaLayout;
+
+// Whether to encode a one-component (Y only) image
+typedef enum
+{
+    GRAY_OFF,  // Always three components
+    GRAY_ON,   // Always grayscale, converting colour input to its luma
+    GRAY_AUTO  // Grayscale when the input is gray (R == G == B everywhere)
+} GrayMode;
+
+// Whole-image encode modes an arena reserves room for, combined as bit
+// flags (see jpeg_arena_size). Ladders and previews need the heap and are
+// refused on arena states.
+typedef enum
+{
+    ARENA_OPTIMIZE = 1,    // optimize_coding: quantized coefficients of the whole image
+    ARENA_PROGRESSIVE = 2, // progressive: the same coefficient buffer
+    ARENA_TARGET_SIZE = 4  // target_size: that buffer plus the unquantized blocks
+} ArenaMode;
+
 // Complete JPEG state
 typedef struct
 {
@@ -64,36 +215,71 @@ typedef struct
     uint32_t width;
     uint32_t height;
     uint8_t quality;
-    uint8_t subsample_factor;
+    ChromaLayout chroma_layout;
+    DctMethod dct_method;
+    const JpegKernels *kernels; // For this CPU, see JpegKernels
+    uint16_t restart_interval; // MCUs per restart segment, 0 for none
+    int num_threads;           // Encoder threads; output does not depend on it
+    int optimize_coding;       // Two passes: build Huffman tables for this image
+    int progressive;           // SOF2 output in the scans of scan_script
+    size_t target_size;        // Largest output in bytes, 0 for none; lowers the quality to fit
+    uint8_t fitted_quality;    // Quality the last target_size encode settled on
+    const JpegRung *ladder;    // Extra outputs at other qualities, see jpeg_set_ladder
+    int ladder_count;
+    const JpegPreview *previews; // Downscaled outputs, see jpeg_set_previews
+    int preview_count;
+    GrayMode gray_mode;        // Whether to encode Y only (one component)
+    int num_components;        // Components of the current encode: 3, or 1 for gray
+    int uses_arena;            // Buffers live in caller memory (jpeg_init_arena)
+    int scanline_input;        // No rgb_data; rows arrive via jpeg_push_scanlines
 
     // Image data
     RGB *rgb_data;
-    YCbCr *ycbcr_data;
+    size_t rgb_capacity; // Pixels rgb_data can hold
+
+    uint32_t next_scanline; // Rows pushed since jpeg_start_scanlines
+
+    StripBuffers strip; // Strip used by the single-threaded path
+
+    // Quantized coefficients of the whole image, for two-pass encodes
+    int16_t *coef_buffer;
+    size_t coef_capacity; // Blocks coef_buffer can hold
+
+    // Unquantized DCT coefficients of the whole image, for target_size
+    int16_t *dct_buffer;
+    size_t dct_capacity; // Blocks dct_buffer can hold
+
+    // Previews being built during an encode, at 1/2, 1/4 and 1/8 scale;
+    // NULL for scales not requested
+    uint8_t *preview_planes[3];
+
+    // Progressive scan script (see jpeg_set_scan_script); 0 scans selects
+    // the default script
+    JpegScan scan_script[MAX_SCANS];
+    int num_scans;
 
     // Output handling
     FILE *outfile;
-    uint8_t *output_buffer;
-    uint32_t buffer_size;
-    uint32_t buffer_position;
-
-    // Bit writing state
-    uint8_t bit_buffer;
-    uint8_t bits_in_buffer;
+    JpegWriter writer;
 
     // Quantization tables
     uint8_t *quant_table_y; // Luminance quantization table
     uint8_t *quant_table_c; // Chrominance quantization table
+    QuantDivisors divisors_y; // Reciprocals of quant_table_y
+    QuantDivisors divisors_c; // Reciprocals of quant_table_c
 
-    // Huffman tables
+    // Huffman tables, as written to DHT and expanded for encoding
+    HuffmanSpec dc_spec_y;
+    HuffmanSpec ac_spec_y;
+    HuffmanSpec dc_spec_c;
+    HuffmanSpec ac_spec_c;
     HuffmanTable dc_table_y; // DC luminance
     HuffmanTable ac_table_y; // AC luminance
     HuffmanTable dc_table_c; // DC chrominance
     HuffmanTable ac_table_c; // AC chrominance
-
-    // DC coefficient tracking
-    int16_t last_dc_y;  // Last DC value for Y component
-    int16_t last_dc_cb; // Last DC value for Cb component
-    int16_t last_dc_cr; // Last DC value for Cr component
 } JpegState;
 
+// huffman.c
+void build_huffman_spec(const uint32_t freq[256], HuffmanSpec *spec);
+
 #endif // JPEG_COMMON_H
\ No newline at end of file
@@ -2,9 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <jpeglib.h>
 #include "jpeg_common.h"
 
+// x86 builds carry SSE2, SSSE3 and AVX2 kernels whatever the compiler
+// targets by default; each is compiled for its own instruction set and
+// jpeg_init binds the widest set the CPU has (see select_kernels)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 static const uint8_t STD_QUANT_TABLE_Y[BLOCK_SIZE][BLOCK_SIZE] = {
     {16, 11, 10, 16, 24, 40, 51, 61},
     {12, 12, 14, 19, 26, 58, 60, 55},
@@ -25,10 +42,12 @@ static const uint8_t STD_QUANT_TABLE_C[BLOCK_SIZE][BLOCK_SIZE] = {
     {99, 99, 99, 99, 99, 99, 99, 99},
     {99, 99, 99, 99, 99, 99, 99, 99}};
 
-static const uint8_t STD_DC_LUMINANCE_CODES[] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0}; // BITS
+// Standard Huffman tables (JPEG Annex K.3) as stored in DHT: BITS holds
+// the number of codes of each length 1-16, VALUES the symbols in code order
+static const uint8_t STD_DC_LUMINANCE_CODES[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0}; // BITS
 static const uint8_t STD_DC_LUMINANCE_VALUES[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
 
-static const uint8_t STD_AC_LUMINANCE_CODES[] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125};
+static const uint8_t STD_AC_LUMINANCE_CODES[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125};
 static const uint8_t STD_AC_LUMINANCE_VALUES[] = {
     0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
     0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
@@ -45,170 +64,275 @@ static const uint8_t STD_AC_LUMINANCE_VALUES[] = {
     0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
     0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
     0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
-    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5};
-
-int init_huffman_tables(JpegState *state)
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+static const uint8_t STD_DC_CHROMINANCE_CODES[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0}; // BITS
+static const uint8_t STD_DC_CHROMINANCE_VALUES[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+static const uint8_t STD_AC_CHROMINANCE_CODES[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119};
+static const uint8_t STD_AC_CHROMINANCE_VALUES[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+// Expand a DHT-style table into per-symbol packed entries. Codes are
+// assigned canonically: consecutive within a length, doubled per length.
+static void build_huffman_table(const HuffmanSpec *spec, HuffmanTable *table)
 {
-    // Standard DC and AC Huffman table values
-    static const uint8_t DC_LUMINANCE_BITS[] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0};
-    static const uint8_t DC_LUMINANCE_VALUES[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
-
-    static const uint8_t AC_LUMINANCE_BITS[] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125};
-    static const uint8_t AC_LUMINANCE_VALUES[] = {
-        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
-        0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
-        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
-        0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
-        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
-        0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
-        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
-        0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
-        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
-        0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
-        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
-        0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
-        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
-        0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
-        0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5};
-
-    // Standard DC and AC chrominance tables
-    static const uint8_t DC_CHROMINANCE_BITS[] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0};
-    static const uint8_t DC_CHROMINANCE_VALUES[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
-
-    static const uint8_t AC_CHROMINANCE_BITS[] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119};
-    static const uint8_t AC_CHROMINANCE_VALUES[] = {
-        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
-        0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
-        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
-        0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
-        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
-        0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
-        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
-        0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
-        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
-        0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
-        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
-        0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
-        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
-        0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
-        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
-        0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3};
-
-    // Allocate memory for Huffman tables
-    state->dc_table_y.codes = malloc(sizeof(HuffmanCode) * 12);  // DC luminance needs 12 codes
-    state->ac_table_y.codes = malloc(sizeof(HuffmanCode) * 256); // AC luminance needs up to 256 codes
-    state->dc_table_c.codes = malloc(sizeof(HuffmanCode) * 12);  // DC chrominance needs 12 codes
-    state->ac_table_c.codes = malloc(sizeof(HuffmanCode) * 256); // AC chrominance needs up to 256 codes
-
-    if (!state->dc_table_y.codes || !state->ac_table_y.codes ||
-        !state->dc_table_c.codes || !state->ac_table_c.codes)
-    {
-        return -1;
-    }
+    uint32_t code = 0;
+    int k = 0;
 
-    // Initialize DC luminance table
-    uint16_t code = 0;
-    int j = 0;
-    for (int i = 0; i < 12; i++)
+    memset(table->entries, 0, sizeof(table->entries));
+    for (int length = 1; length <= 16; length++)
     {
-        for (int k = 0; k < DC_LUMINANCE_BITS[i]; k++)
+        for (int i = 0; i < spec->bits[length - 1]; i++)
         {
-            state->dc_table_y.codes[j].code_length = i + 1;
-            state->dc_table_y.codes[j].code = code;
+            table->entries[spec->values[k++]] = (code << 8) | length;
             code++;
-            j++;
         }
         code <<= 1;
     }
-    state->dc_table_y.count = j;
+}
 
-    // Initialize AC luminance table
-    code = 0;
-    j = 0;
+static void set_huffman_spec(HuffmanSpec *spec, const uint8_t bits[16], const uint8_t *values)
+{
+    memcpy(spec->bits, bits, sizeof(spec->bits));
+    spec->count = 0;
     for (int i = 0; i < 16; i++)
     {
-        for (int k = 0; k < AC_LUMINANCE_BITS[i]; k++)
-        {
-            state->ac_table_y.codes[j].code_length = i + 1;
-            state->ac_table_y.codes[j].code = code;
-            code++;
-            j++;
-        }
-        code <<= 1;
+        spec->count += bits[i];
     }
-    state->ac_table_y.count = j;
+    memcpy(spec->values, values, spec->count);
+}
+
+// Expand the four DHT tables held in state
+static void build_huffman_tables(JpegState *state)
+{
+    build_huffman_table(&state->dc_spec_y, &state->dc_table_y);
+    build_huffman_table(&state->ac_spec_y, &state->ac_table_y);
+    build_huffman_table(&state->dc_spec_c, &state->dc_table_c);
+    build_huffman_table(&state->ac_spec_c, &state->ac_table_c);
+}
+
+int init_huffman_tables(JpegState *state)
+{
+    set_huffman_spec(&state->dc_spec_y, STD_DC_LUMINANCE_CODES, STD_DC_LUMINANCE_VALUES);
+    set_huffman_spec(&state->ac_spec_y, STD_AC_LUMINANCE_CODES, STD_AC_LUMINANCE_VALUES);
+    set_huffman_spec(&state->dc_spec_c, STD_DC_CHROMINANCE_CODES, STD_DC_CHROMINANCE_VALUES);
+    set_huffman_spec(&state->ac_spec_c, STD_AC_CHROMINANCE_CODES, STD_AC_CHROMINANCE_VALUES);
+    build_huffman_tables(state);
+
+    return 0;
+}
+
+// buffer management
+static inline uint32_t align_up(uint32_t value, uint32_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Cache-line aligned allocation for planes that SIMD kernels stream over;
+// release with free()
+static void *aligned_alloc64(size_t size)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 64, size) != 0)
+        return NULL;
+    return ptr;
+}
+
+// Caller-provided memory that buffers are carved from in order, each
+// aligned like aligned_alloc64; nothing is ever returned to it
+typedef struct
+{
+    uint8_t *next;
+    uint8_t *end;
+} Arena;
+
+#define ARENA_ALIGN 64
+
+static void *arena_alloc(Arena *arena, size_t size)
+{
+    uint8_t *ptr = (uint8_t *)(((uintptr_t)arena->next + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    if (ptr > arena->end || size > (size_t)(arena->end - ptr))
+        return NULL;
+    arena->next = ptr + size;
+    return ptr;
+}
+
+// Arena bytes an allocation of size takes up
+static inline size_t arena_footprint(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+// Allocate from arena if there is one, from the heap otherwise
+static void *buffer_alloc(Arena *arena, size_t size)
+{
+    return arena ? arena_alloc(arena, size) : aligned_alloc64(size);
+}
 
-    // Initialize DC chrominance table
-    code = 0;
-    j = 0;
-    for (int i = 0; i < 12; i++)
+// Hand the buffered bytes to the sink. After a sink failure the rest of
+// the output is discarded and the encode reports the error at the end.
+static void flush_output(JpegWriter *writer)
+{
+    if (writer->buffer_position > 0 && !writer->sink_error)
     {
-        for (int k = 0; k < DC_CHROMINANCE_BITS[i]; k++)
-        {
-            state->dc_table_c.codes[j].code_length = i + 1;
-            state->dc_table_c.codes[j].code = code;
-            code++;
-            j++;
-        }
-        code <<= 1;
+        if (writer->sink.write(writer->sink.opaque, writer->buffer, writer->buffer_position) != 0)
+            writer->sink_error = 1;
     }
-    state->dc_table_c.count = j;
+    writer->buffer_position = 0;
+}
 
-    // Initialize AC chrominance table
-    code = 0;
-    j = 0;
-    for (int i = 0; i < 16; i++)
+// Make room for needed_size more bytes (at most OUTPUT_BUFFER_SIZE)
+static inline void ensure_buffer_capacity(JpegWriter *writer, size_t needed_size)
+{
+    if (writer->buffer_position + needed_size > writer->buffer_size)
+        flush_output(writer);
+}
+
+static void write_byte(JpegState *state, uint8_t byte)
+{
+    JpegWriter *writer = &state->writer;
+    if (writer->buffer_position >= writer->buffer_size)
+        flush_output(writer);
+    writer->buffer[writer->buffer_position++] = byte;
+}
+
+// Append a block of already encoded bytes, bypassing the buffer when it
+// would not fit anyway
+static void write_bytes(JpegState *state, const uint8_t *data, size_t size)
+{
+    JpegWriter *writer = &state->writer;
+    if (writer->buffer_position + size <= writer->buffer_size)
     {
-        for (int k = 0; k < AC_CHROMINANCE_BITS[i]; k++)
-        {
-            state->ac_table_c.codes[j].code_length = i + 1;
-            state->ac_table_c.codes[j].code = code;
-            code++;
-            j++;
-        }
-        code <<= 1;
+        memcpy(writer->buffer + writer->buffer_position, data, size);
+        writer->buffer_position += size;
+        return;
     }
-    state->ac_table_c.count = j;
 
-    return 0;
+    flush_output(writer);
+    if (size > 0 && !writer->sink_error && writer->sink.write(writer->sink.opaque, data, size) != 0)
+        writer->sink_error = 1;
 }
 
-// buffer management
-static void ensure_buffer_capacity(JpegState *state, size_t needed_size)
+// Start a writer on buffer (buffer_size bytes) feeding sink
+static void init_writer(JpegWriter *writer, JpegSink sink, uint8_t *buffer, uint32_t buffer_size)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->sink = sink;
+    writer->buffer = buffer;
+    writer->buffer_size = buffer_size;
+}
+
+// sinks
+static int file_sink_write(void *opaque, const uint8_t *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE *)opaque) == size ? 0 : -1;
+}
+
+static int fd_sink_write(void *opaque, const uint8_t *data, size_t size)
 {
-    if (state->buffer_position + needed_size > state->buffer_size)
+    const int fd = (int)(intptr_t)opaque;
+    while (size > 0)
     {
-        size_t new_size = state->buffer_size * 2;
-        while (new_size < state->buffer_position + needed_size)
+        const ssize_t written = write(fd, data, size);
+        if (written < 0)
         {
-            new_size *= 2;
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
 
-        uint8_t *new_buffer = realloc(state->output_buffer, new_size);
-        if (!new_buffer)
+static int memory_sink_write(void *opaque, const uint8_t *data, size_t size)
+{
+    JpegMemoryBuffer *mem = opaque;
+    if (mem->size + size > mem->capacity)
+    {
+        size_t new_capacity = mem->capacity ? mem->capacity * 2 : OUTPUT_BUFFER_SIZE * 4;
+        while (new_capacity < mem->size + size)
         {
-            // Handle allocation failure
-            return;
+            new_capacity *= 2;
         }
 
-        state->output_buffer = new_buffer;
-        state->buffer_size = new_size;
+        uint8_t *new_data = realloc(mem->data, new_capacity);
+        if (!new_data)
+            return -1;
+        mem->data = new_data;
+        mem->capacity = new_capacity;
     }
+    memcpy(mem->data + mem->size, data, size);
+    mem->size += size;
+    return 0;
 }
 
-static void write_byte(JpegState *state, uint8_t byte)
+// Write to a stdio stream; the caller keeps ownership of file
+JpegSink jpeg_file_sink(FILE *file)
 {
-    if (state->buffer_position >= state->buffer_size)
+    JpegSink sink = {file_sink_write, file};
+    return sink;
+}
+
+// Write to a file descriptor (file, pipe or socket), retrying short writes
+JpegSink jpeg_fd_sink(int fd)
+{
+    JpegSink sink = {fd_sink_write, (void *)(intptr_t)fd};
+    return sink;
+}
+
+// Append to a growable memory buffer; zero-initialize mem before first use
+JpegSink jpeg_memory_sink(JpegMemoryBuffer *mem)
+{
+    JpegSink sink = {memory_sink_write, mem};
+    return sink;
+}
+
+// File sink that creates its file on the first write, so an input that
+// turns out not to be transcodable leaves no empty output behind
+typedef struct
+{
+    const char *filename;
+    FILE *file;
+} LazyFileSink;
+
+static int lazy_file_sink_write(void *opaque, const uint8_t *data, size_t size)
+{
+    LazyFileSink *lazy = opaque;
+    if (!lazy->file)
     {
-        size_t new_size = state->buffer_size * 2;
-        uint8_t *new_buffer = realloc(state->output_buffer, new_size);
-        if (!new_buffer)
-            return;
-        state->output_buffer = new_buffer;
-        state->buffer_size = new_size;
+        lazy->file = fopen(lazy->filename, "wb");
+        if (!lazy->file)
+            return -1;
     }
-    state->output_buffer[state->buffer_position++] = byte;
+    return file_sink_write(lazy->file, data, size);
 }
 
 static void write_marker(JpegState *state, JpegMarker marker)
@@ -239,227 +363,245 @@ static void write_app0(JpegState *state)
     write_byte(state, 0);    // Thumbnail height
 }
 
-static void write_dht(JpegState *state)
+// Write one table of a DHT segment: class/id byte, BITS, then VALUES
+static void write_dht_table(JpegState *state, uint8_t class_id, const HuffmanSpec *spec)
+{
+    write_byte(state, class_id);
+    for (int i = 0; i < 16; i++)
+    {
+        write_byte(state, spec->bits[i]); // BITS
+    }
+    for (int i = 0; i < spec->count; i++)
+    {
+        write_byte(state, spec->values[i]); // VALUES
+    }
+}
+
+// Write a DHT segment holding the tables selected by mask, bit i standing
+// for table i in the order DC Y, AC Y, DC C, AC C
+static void write_dht(JpegState *state, unsigned mask)
 {
+    static const uint8_t CLASS_ID[4] = {0x00, 0x10, 0x01, 0x11}; // Class << 4 | table
+    const HuffmanSpec *specs[4] = {&state->dc_spec_y, &state->ac_spec_y, &state->dc_spec_c, &state->ac_spec_c};
+
     // Start of DHT marker
-    write_marker(state, 0xC4);
+    write_marker(state, MARKER_DHT);
 
     // Compute length of DHT segment
     size_t length = 2; // Length field itself
-    length += 1 + 12;  // DC Luminance table
-    length += 1 + 162; // AC Luminance table
-    length += 1 + 12;  // DC Chrominance table
-    length += 1 + 162; // AC Chrominance table
+    for (int i = 0; i < 4; i++)
+    {
+        if (mask & (1u << i))
+            length += 1 + 16 + specs[i]->count;
+    }
 
     write_word(state, length);
 
-    // Write DC Luminance table
-    write_byte(state, 0x00); // Table ID 0 (DC, Luminance)
-    for (int i = 0; i < 12; i++)
-    {
-        write_byte(state, STD_DC_LUMINANCE_CODES[i]); // BITS
-    }
-    for (int i = 0; i < 12; i++)
+    for (int i = 0; i < 4; i++)
     {
-        write_byte(state, STD_DC_LUMINANCE_VALUES[i]); // VALUES
+        if (mask & (1u << i))
+            write_dht_table(state, CLASS_ID[i], specs[i]);
     }
+}
 
-    // Write AC Luminance table
-    write_byte(state, 0x10); // Table ID 1 (AC, Luminance)
-    for (int i = 0; i < 16; i++)
-    {
-        write_byte(state, STD_AC_LUMINANCE_CODES[i]); // BITS
-    }
-    for (int i = 0; i < 162; i++)
-    {
-        write_byte(state, STD_AC_LUMINANCE_VALUES[i]); // VALUES
-    }
+static void write_dri(JpegState *state)
+{
+    write_marker(state, MARKER_DRI);
+    write_word(state, 4);                       // Length: 4 bytes
+    write_word(state, state->restart_interval); // MCUs per restart interval
+}
 
-    // Write DC Chrominance table
-    write_byte(state, 0x01); // Table ID 0 (DC, Chrominance)
-    for (int i = 0; i < 12; i++)
-    {
-        write_byte(state, STD_DC_LUMINANCE_CODES[i]); // BITS
-    }
-    for (int i = 0; i < 12; i++)
+// Start of Scan for the components and band of scan. Y codes with
+// Huffman tables 0, chroma with tables 1.
+static void write_sos(JpegState *state, const JpegScan *scan)
+{
+    write_marker(state, MARKER_SOS);                  // Start of Scan marker
+    write_word(state, 6 + 2 * scan->component_count); // Length
+
+    write_byte(state, scan->component_count); // Number of components
+    for (int i = 0; i < scan->component_count; i++)
     {
-        write_byte(state, STD_DC_LUMINANCE_VALUES[i]); // VALUES
+        const int component = scan->components[i];
+        write_byte(state, component + 1);           // Component ID
+        write_byte(state, component ? 0x11 : 0x00); // Huffman tables (DC, AC)
     }
 
-    // Write AC Chrominance table
-    write_byte(state, 0x11); // Table ID 1 (AC, Chrominance)
-    for (int i = 0; i < 16; i++)
+    write_byte(state, scan->ss);                 // Start of spectral selection
+    write_byte(state, scan->se);                 // End of spectral selection
+    write_byte(state, scan->ah << 4 | scan->al); // Successive approximation
+}
+
+// Entropy-coded bits are gathered MSB-first in a 64-bit accumulator and
+// written out a whole word at a time. A 0xFF byte in the data must be
+// followed by a stuffed 0x00, but that is rare, so each word is tested for
+// 0xFF bytes at once and only those words take the byte-wise path.
+#define HAS_FF_BYTE(w) ((~(w) - 0x0101010101010101ULL) & (w) & 0x8080808080808080ULL)
+
+static void flush_bit_word(JpegWriter *writer, uint64_t word)
+{
+    // Worst case: every byte is 0xFF and gets stuffed
+    ensure_buffer_capacity(writer, 2 * sizeof(word));
+    uint8_t *out = writer->buffer + writer->buffer_position;
+
+    if (!HAS_FF_BYTE(word))
     {
-        write_byte(state, STD_AC_LUMINANCE_CODES[i]); // BITS
+        const uint64_t be = __builtin_bswap64(word);
+        memcpy(out, &be, sizeof(be));
+        writer->buffer_position += sizeof(be);
+        return;
     }
-    for (int i = 0; i < 162; i++)
+
+    for (int shift = 56; shift >= 0; shift -= 8)
     {
-        write_byte(state, STD_AC_LUMINANCE_VALUES[i]); // VALUES
+        const uint8_t byte = (uint8_t)(word >> shift);
+        *out++ = byte;
+        if (byte == 0xFF)
+            *out++ = 0x00; // Byte stuffing
     }
+    writer->buffer_position = (uint32_t)(out - writer->buffer);
 }
 
-static void write_sos(JpegState *state)
+// Append the low bit_count bits of bits (1..32); higher bits must be zero
+static inline void write_bits(JpegWriter *writer, uint32_t bits, int bit_count)
 {
-    write_marker(state, 0xDA); // Start of Scan marker
-    write_word(state, 12);     // Length: 12 bytes
-
-    write_byte(state, 3); // Number of components
-
-    // Component 1: Y
-    write_byte(state, 1);    // Component ID
-    write_byte(state, 0x00); // Huffman table (DC: 0, AC: 0)
-
-    // Component 2: Cb
-    write_byte(state, 2);    // Component ID
-    write_byte(state, 0x11); // Huffman table (DC: 1, AC: 1)
+    if (bit_count <= 0)
+        return;
 
-    // Component 3: Cr
-    write_byte(state, 3);    // Component ID
-    write_byte(state, 0x11); // Huffman table (DC: 1, AC: 1)
+    const int free_bits = 64 - writer->bits_in_buffer;
+    if (bit_count < free_bits)
+    {
+        writer->bit_buffer = (writer->bit_buffer << bit_count) | bits;
+        writer->bits_in_buffer += bit_count;
+        return;
+    }
 
-    // Spectral selection (default for baseline JPEG)
-    write_byte(state, 0);  // Start of spectral selection
-    write_byte(state, 63); // End of spectral selection
-    write_byte(state, 0);  // Successive approximation
+    // Fill the word with the top of bits, flush it and keep the remainder.
+    // Bits of the remainder above the new count are shifted out later.
+    const int spill = bit_count - free_bits;
+    flush_bit_word(writer, (writer->bit_buffer << free_bits) | ((uint64_t)bits >> spill));
+    writer->bit_buffer = bits;
+    writer->bits_in_buffer = spill;
 }
 
-// bit writing with overflow protection
-void write_bits(JpegState *state, uint32_t bits, int bit_count)
+// Write out the pending bits at the end of the scan, padding the last
+// byte with 1 bits as the standard requires
+static void flush_bits(JpegWriter *writer)
 {
-    if (bit_count <= 0 || bit_count > 32)
-        return;
-
-    ensure_buffer_capacity(state, (bit_count + state->bits_in_buffer + 7) / 8 + 1);
+    int count = writer->bits_in_buffer;
+    ensure_buffer_capacity(writer, 2 * sizeof(writer->bit_buffer));
 
-    while (bit_count > 0)
+    while (count > 0)
     {
-        // Fill bit buffer from left to right
-        state->bit_buffer = (state->bit_buffer << 1) |
-                            ((bits >> (bit_count - 1)) & 1);
-        state->bits_in_buffer++;
-        bit_count--;
-
-        if (state->bits_in_buffer == 8)
+        uint8_t byte;
+        if (count >= 8)
         {
-            write_byte(state, state->bit_buffer);
-            if (state->bit_buffer == 0xFF)
-            {
-                write_byte(state, 0x00); // Byte stuffing
-            }
-            state->bit_buffer = 0;
-            state->bits_in_buffer = 0;
+            count -= 8;
+            byte = (uint8_t)(writer->bit_buffer >> count);
+        }
+        else
+        {
+            byte = (uint8_t)((writer->bit_buffer << (8 - count)) | (0xFF >> count));
+            count = 0;
         }
+
+        writer->buffer[writer->buffer_position++] = byte;
+        if (byte == 0xFF)
+            writer->buffer[writer->buffer_position++] = 0x00; // Byte stuffing
     }
+
+    writer->bit_buffer = 0;
+    writer->bits_in_buffer = 0;
 }
 
-static void build_huffman_tables(JpegState *state)
+// Number of bits needed for the magnitude of v (JPEG size category)
+static inline int magnitude_category(uint32_t v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+// Emit a symbol's Huffman code and its nbits amplitude bits with a single
+// write_bits call; codes are at most 16 bits and amplitudes at most 11
+static inline void emit_symbol(JpegWriter *writer, const HuffmanTable *table, int symbol,
+                               uint32_t amplitude, int nbits)
 {
-    // Allocate memory for Huffman tables
-    state->dc_table_y.codes = malloc(sizeof(HuffmanCode) * 12);
-    state->ac_table_y.codes = malloc(sizeof(HuffmanCode) * 256);
-    state->dc_table_c.codes = malloc(sizeof(HuffmanCode) * 12);
-    state->ac_table_c.codes = malloc(sizeof(HuffmanCode) * 256);
+    const uint32_t entry = table->entries[symbol];
+    write_bits(writer, ((entry >> 8) << nbits) | amplitude, (entry & 0xFF) + nbits);
+}
+
+// Entropy code one quantized block in zigzag order. The amplitude of a
+// negative value is its one's complement in nbits bits, which is v - 1
+// masked; the sign mask makes both the category and that branch-free.
+static void huffman_encode_block(JpegWriter *writer, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE],
+                                 int16_t *last_dc, const HuffmanTable *dc_table,
+                                 const HuffmanTable *ac_table)
+{
+    // DC: difference from the previous block of the same component
+    int value = zigzag[0] - *last_dc;
+    *last_dc = zigzag[0];
 
-    uint16_t code = 0;
-    int si;
+    int sign = value >> 31;
+    int nbits = magnitude_category((uint32_t)((value ^ sign) - sign));
+    emit_symbol(writer, dc_table, nbits, (uint32_t)(value + sign) & ((1u << nbits) - 1), nbits);
 
-    // Build DC luminance table
-    for (int i = 0, j = 0; i < 16; i++)
+    // AC: (run, size) symbols, ZRL for runs of 16 zeros, EOB after the last
+    int run = 0;
+    for (int i = 1; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        for (si = 0; si < STD_DC_LUMINANCE_CODES[i]; si++)
+        value = zigzag[i];
+        if (value == 0)
         {
-            state->dc_table_y.codes[j].code_length = i + 1;
-            state->dc_table_y.codes[j].code = code;
-            j++;
-            code++;
+            run++;
+            continue;
         }
-        code <<= 1;
-    }
-    state->dc_table_y.count = 12;
 
-    // Build AC luminance table
-    code = 0;
-    for (int i = 0, j = 0; i < 16; i++)
-    {
-        for (si = 0; si < STD_AC_LUMINANCE_CODES[i]; si++)
+        while (run > 15)
         {
-            state->ac_table_y.codes[j].code_length = i + 1;
-            state->ac_table_y.codes[j].code = code;
-            j++;
-            code++;
+            emit_symbol(writer, ac_table, 0xF0, 0, 0); // ZRL
+            run -= 16;
         }
-        code <<= 1;
+
+        sign = value >> 31;
+        nbits = magnitude_category((uint32_t)((value ^ sign) - sign));
+        emit_symbol(writer, ac_table, (run << 4) | nbits, (uint32_t)(value + sign) & ((1u << nbits) - 1), nbits);
+        run = 0;
     }
-    state->ac_table_y.count = 162;
 
-    // TODO: Build DC/AC chrominance tables (similar process)
+    if (run > 0)
+    {
+        emit_symbol(writer, ac_table, 0x00, 0, 0); // EOB
+    }
 }
 
-static void huffman_encode_block(JpegState *state, const RLECode *codes, size_t count)
+// Tally the symbols huffman_encode_block would emit for a block
+static void count_block_symbols(const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int16_t *last_dc,
+                                uint32_t dc_freq[256], uint32_t ac_freq[256])
 {
-    for (size_t i = 0; i < count; i++)
+    const int diff = zigzag[0] - *last_dc;
+    *last_dc = zigzag[0];
+    dc_freq[magnitude_category((uint32_t)abs(diff))]++;
+
+    int run = 0;
+    for (int i = 1; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        if (i == 0)
+        const int value = zigzag[i];
+        if (value == 0)
         {
-            // Encode DC coefficient
-            int diff = codes[i].value - state->last_dc_y;
-            state->last_dc_y = codes[i].value;
-
-            // Calculate size category
-            int size = 0;
-            int abs_diff = abs(diff);
-            while (abs_diff > 0)
-            {
-                size++;
-                abs_diff >>= 1;
-            }
-
-            // Write size using DC Huffman table
-            const HuffmanCode *huff_code = &state->dc_table_y.codes[size];
-            write_bits(state, huff_code->code, huff_code->code_length);
-
-            // Write amplitude
-            if (diff < 0)
-            {
-                diff = diff - 1;
-            }
-            if (size > 0)
-            {
-                write_bits(state, diff & ((1 << size) - 1), size);
-            }
+            run++;
+            continue;
         }
-        else
-        {
-            // Encode AC coefficient
-            int run_length = codes[i].run_length;
-            int value = codes[i].value;
-
-            // Calculate size category
-            int size = 0;
-            int abs_value = abs(value);
-            while (abs_value > 0)
-            {
-                size++;
-                abs_value >>= 1;
-            }
 
-            // Create composite value for Huffman lookup
-            int composite = (run_length << 4) | size;
-
-            // Write using AC Huffman table
-            const HuffmanCode *huff_code = &state->ac_table_y.codes[composite];
-            write_bits(state, huff_code->code, huff_code->code_length);
-
-            // Write amplitude
-            if (value < 0)
-            {
-                value = value - 1;
-            }
-            if (size > 0)
-            {
-                write_bits(state, value & ((1 << size) - 1), size);
-            }
+        while (run > 15)
+        {
+            ac_freq[0xF0]++; // ZRL
+            run -= 16;
         }
+        ac_freq[(run << 4) | magnitude_category((uint32_t)abs(value))]++;
+        run = 0;
+    }
+
+    if (run > 0)
+    {
+        ac_freq[0x00]++; // EOB
     }
 }
 
@@ -493,595 +635,4557 @@ static DctBlock apply_dct(const uint8_t input[BLOCK_SIZE][BLOCK_SIZE])
     return dct;
 }
 
-static void quantize_block(DctBlock *dct, const uint8_t quant_table[BLOCK_SIZE][BLOCK_SIZE])
+// AAN (Arai, Agui, Nakajima) fast DCT constants.
+// The AAN butterflies leave output (u, v) scaled by 8 * a[u] * a[v], where
+// a[0] = 1 and a[k] = sqrt(2) * cos(k * PI / 16). AAN_DESCALE[k] holds
+// 1 / (2 * sqrt(2) * a[k]) so a single multiply per coefficient undoes it.
+// Constants carry 17 significant digits, the full precision of a double.
+#define AAN_C4 0.70710678118654752 // cos(4 * PI / 16)
+#define AAN_C6 0.38268343236508977 // cos(6 * PI / 16)
+#define AAN_C2_MINUS_C6 0.54119610014619698
+#define AAN_C2_PLUS_C6 1.3065629648763765
+
+static const double AAN_DESCALE[BLOCK_SIZE] = {
+    0.35355339059327376, 0.25489778955207958, 0.27059805007309849, 0.30067244346752264,
+    0.35355339059327376, 0.44998811156820785, 0.65328148243818826, 1.2814577238707531};
+
+// One 8-point AAN butterfly pass, reading and writing with the given stride.
+// Instantiated for double and float so both precisions share one data flow.
+#define DEFINE_AAN_PASS(name, type)                                         \
+    static inline void name(type *d, int stride)                            \
+    {                                                                       \
+        type tmp0 = d[0 * stride] + d[7 * stride];                          \
+        type tmp7 = d[0 * stride] - d[7 * stride];                          \
+        type tmp1 = d[1 * stride] + d[6 * stride];                          \
+        type tmp6 = d[1 * stride] - d[6 * stride];                          \
+        type tmp2 = d[2 * stride] + d[5 * stride];                          \
+        type tmp5 = d[2 * stride] - d[5 * stride];                          \
+        type tmp3 = d[3 * stride] + d[4 * stride];                          \
+        type tmp4 = d[3 * stride] - d[4 * stride];                          \
+                                                                            \
+        /* Even part */                                                     \
+        type tmp10 = tmp0 + tmp3;                                           \
+        type tmp13 = tmp0 - tmp3;                                           \
+        type tmp11 = tmp1 + tmp2;                                           \
+        type tmp12 = tmp1 - tmp2;                                           \
+                                                                            \
+        d[0 * stride] = tmp10 + tmp11;                                      \
+        d[4 * stride] = tmp10 - tmp11;                                      \
+                                                                            \
+        type z1 = (tmp12 + tmp13) * (type)AAN_C4;                           \
+        d[2 * stride] = tmp13 + z1;                                         \
+        d[6 * stride] = tmp13 - z1;                                         \
+                                                                            \
+        /* Odd part */                                                      \
+        tmp10 = tmp4 + tmp5;                                                \
+        tmp11 = tmp5 + tmp6;                                                \
+        tmp12 = tmp6 + tmp7;                                                \
+                                                                            \
+        type z5 = (tmp10 - tmp12) * (type)AAN_C6;                           \
+        type z2 = (type)AAN_C2_MINUS_C6 * tmp10 + z5;                       \
+        type z4 = (type)AAN_C2_PLUS_C6 * tmp12 + z5;                        \
+        type z3 = tmp11 * (type)AAN_C4;                                     \
+                                                                            \
+        type z11 = tmp7 + z3;                                               \
+        type z13 = tmp7 - z3;                                               \
+                                                                            \
+        d[5 * stride] = z13 + z2;                                           \
+        d[3 * stride] = z13 - z2;                                           \
+        d[1 * stride] = z11 + z4;                                           \
+        d[7 * stride] = z11 - z4;                                           \
+    }
+
+DEFINE_AAN_PASS(aan_pass_f64, double)
+DEFINE_AAN_PASS(aan_pass_f32, float)
+
+// Separable fast DCT: 8 row passes, 8 column passes, then one descale
+// multiply per coefficient. Output matches apply_dct up to rounding.
+static DctBlock apply_dct_fast(const uint8_t input[BLOCK_SIZE][BLOCK_SIZE])
 {
-    for (int u = 0; u < BLOCK_SIZE; u++)
+    DctBlock dct;
+
+    for (int x = 0; x < BLOCK_SIZE; x++)
     {
-        for (int v = 0; v < BLOCK_SIZE; v++)
+        for (int y = 0; y < BLOCK_SIZE; y++)
         {
-            dct->data[u][v] = round(dct->data[u][v] / quant_table[u][v]);
+            dct.data[x][y] = input[x][y] - 128.0;
         }
+        aan_pass_f64(dct.data[x], 1);
     }
-}
-
-const int ZIGZAG_PATTERN[64][2] = {
-    {0, 0}, {0, 1}, {1, 0}, {2, 0}, {1, 1}, {0, 2}, {0, 3}, {1, 2}, {2, 1}, {3, 0}, {4, 0}, {3, 1}, {2, 2}, {1, 3}, {0, 4}, {0, 5}, {1, 4}, {2, 3}, {3, 2}, {4, 1}, {5, 0}, {6, 0}, {5, 1}, {4, 2}, {3, 3}, {2, 4}, {1, 5}, {0, 6}, {0, 7}, {1, 6}, {2, 5}, {3, 4}, {4, 3}, {5, 2}, {6, 1}, {7, 0}, {7, 1}, {6, 2}, {5, 3}, {4, 4}, {3, 5}, {2, 6}, {1, 7}, {2, 7}, {3, 6}, {4, 5}, {5, 4}, {6, 3}, {7, 2}, {7, 3}, {6, 4}, {5, 5}, {4, 6}, {3, 7}, {4, 7}, {5, 6}, {6, 5}, {7, 4}, {7, 5}, {6, 6}, {5, 7}, {6, 7}, {7, 6}, {7, 7}};
 
-void zigzag_scan(const DctBlock *dct, int output[BLOCK_SIZE * BLOCK_SIZE])
-{
+    for (int v = 0; v < BLOCK_SIZE; v++)
+    {
+        aan_pass_f64(&dct.data[0][v], BLOCK_SIZE);
+    }
 
-    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    for (int u = 0; u < BLOCK_SIZE; u++)
     {
-        int row = ZIGZAG_PATTERN[i][0];
-        int col = ZIGZAG_PATTERN[i][1];
-        output[i] = (int)dct->data[row][col];
+        for (int v = 0; v < BLOCK_SIZE; v++)
+        {
+            dct.data[u][v] *= AAN_DESCALE[u] * AAN_DESCALE[v];
+        }
     }
+
+    return dct;
 }
 
-int run_length_encode(const int zigzag[BLOCK_SIZE * BLOCK_SIZE],
-                      RLECode output[BLOCK_SIZE * BLOCK_SIZE])
+static DctBlockF32 apply_dct_fast_f32(const uint8_t input[BLOCK_SIZE][BLOCK_SIZE])
 {
-    int code_count = 0;
-    int zero_count = 0;
+    DctBlockF32 dct;
 
-    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    for (int x = 0; x < BLOCK_SIZE; x++)
     {
-        if (zigzag[i] == 0)
+        for (int y = 0; y < BLOCK_SIZE; y++)
         {
-
-            zero_count++;
+            dct.data[x][y] = input[x][y] - 128.0f;
         }
-        else
-        {
+        aan_pass_f32(dct.data[x], 1);
+    }
 
-            output[code_count].run_length = zero_count;
-            output[code_count].value = zigzag[i];
-            code_count++;
-            zero_count = 0;
-        }
+    for (int v = 0; v < BLOCK_SIZE; v++)
+    {
+        aan_pass_f32(&dct.data[0][v], BLOCK_SIZE);
     }
 
-    if (zero_count > 0)
+    for (int u = 0; u < BLOCK_SIZE; u++)
     {
-        output[code_count].run_length = 0;
-        output[code_count].value = 0;
-        code_count++;
+        for (int v = 0; v < BLOCK_SIZE; v++)
+        {
+            dct.data[u][v] *= (float)(AAN_DESCALE[u] * AAN_DESCALE[v]);
+        }
     }
 
-    return code_count;
+    return dct;
 }
 
-// compression pipeline
-static void process_mcu(JpegState *state, uint32_t x, uint32_t y)
+// Run the forward DCT selected by state->dct_method
+static DctBlock forward_dct(const JpegState *state, const uint8_t input[BLOCK_SIZE][BLOCK_SIZE])
 {
-    uint8_t block[BLOCK_SIZE][BLOCK_SIZE];
-
-    // Extract Y (luminance) block
-    for (int by = 0; by < BLOCK_SIZE; by++)
+    switch (state->dct_method)
+    {
+    case DCT_REFERENCE:
+        return apply_dct(input);
+    case DCT_FAST_FLOAT:
     {
-        for (int bx = 0; bx < BLOCK_SIZE; bx++)
+        DctBlockF32 f32 = apply_dct_fast_f32(input);
+        DctBlock dct;
+        for (int u = 0; u < BLOCK_SIZE; u++)
         {
-            if (y + by < state->height && x + bx < state->width)
-            {
-                block[by][bx] = state->ycbcr_data[(y + by) * state->width + (x + bx)].y;
-            }
-            else
+            for (int v = 0; v < BLOCK_SIZE; v++)
             {
-                block[by][bx] = block[by - 1][bx - 1]; // Edge padding
+                dct.data[u][v] = f32.data[u][v];
             }
         }
+        return dct;
     }
+    case DCT_FAST:
+    default:
+        return apply_dct_fast(input);
+    }
+}
 
-    // Process Y block
-    DctBlock dct = apply_dct(block);
-    quantize_block(&dct, STD_QUANT_TABLE_Y);
-
-    // Zigzag scan
-    int zigzag_data[BLOCK_SIZE * BLOCK_SIZE];
-    zigzag_scan(&dct, zigzag_data);
-
-    // Run-length encode
-    RLECode rle_codes[BLOCK_SIZE * BLOCK_SIZE];
-    int code_count = run_length_encode(zigzag_data, rle_codes);
+// Fixed-point forward DCT (Loeffler-Ligtenberg-Moschytz, as in libjpeg's
+// jfdctint). Constants are scaled by 2^13; pass 1 keeps 2 extra bits of
+// precision that pass 2 removes. Output is int16 in natural order, scaled
+// up by 8 relative to apply_dct.
+#define ISLOW_CONST_BITS 13
+#define ISLOW_PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+#define ISLOW_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+static inline void fdct_islow_1d(int32_t *d, int stride, int first_pass)
+{
+    const int shift = first_pass ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS
+                                 : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+    int32_t tmp0 = d[0 * stride] + d[7 * stride];
+    int32_t tmp7 = d[0 * stride] - d[7 * stride];
+    int32_t tmp1 = d[1 * stride] + d[6 * stride];
+    int32_t tmp6 = d[1 * stride] - d[6 * stride];
+    int32_t tmp2 = d[2 * stride] + d[5 * stride];
+    int32_t tmp5 = d[2 * stride] - d[5 * stride];
+    int32_t tmp3 = d[3 * stride] + d[4 * stride];
+    int32_t tmp4 = d[3 * stride] - d[4 * stride];
+
+    // Even part
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+
+    if (first_pass)
+    {
+        d[0 * stride] = (tmp10 + tmp11) * (1 << ISLOW_PASS1_BITS);
+        d[4 * stride] = (tmp10 - tmp11) * (1 << ISLOW_PASS1_BITS);
+    }
+    else
+    {
+        // Ties round away from zero; plain DESCALE would bias these rows by
+        // +1/64 on average since a quarter of all inputs land on a tie
+        const int32_t sum = tmp10 + tmp11;
+        const int32_t diff = tmp10 - tmp11;
+        d[0 * stride] = ISLOW_DESCALE(sum - (sum < 0), ISLOW_PASS1_BITS);
+        d[4 * stride] = ISLOW_DESCALE(diff - (diff < 0), ISLOW_PASS1_BITS);
+    }
 
-    // Huffman encode
-    huffman_encode_block(state, rle_codes, code_count);
+    int32_t z1 = (tmp12 + tmp13) * FIX_0_541196100;
+    d[2 * stride] = ISLOW_DESCALE(z1 + tmp13 * FIX_0_765366865, shift);
+    d[6 * stride] = ISLOW_DESCALE(z1 - tmp12 * FIX_1_847759065, shift);
+
+    // Odd part
+    z1 = tmp4 + tmp7;
+    int32_t z2 = tmp5 + tmp6;
+    int32_t z3 = tmp4 + tmp6;
+    int32_t z4 = tmp5 + tmp7;
+    const int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+    tmp4 *= FIX_0_298631336;
+    tmp5 *= FIX_2_053119869;
+    tmp6 *= FIX_3_072711026;
+    tmp7 *= FIX_1_501321110;
+    z1 *= -FIX_0_899976223;
+    z2 *= -FIX_2_562915447;
+    z3 = z3 * -FIX_1_961570560 + z5;
+    z4 = z4 * -FIX_0_390180644 + z5;
+
+    d[7 * stride] = ISLOW_DESCALE(tmp4 + z1 + z3, shift);
+    d[5 * stride] = ISLOW_DESCALE(tmp5 + z2 + z4, shift);
+    d[3 * stride] = ISLOW_DESCALE(tmp6 + z2 + z3, shift);
+    d[1 * stride] = ISLOW_DESCALE(tmp7 + z1 + z4, shift);
+}
 
-    // Complete MCU processing for Cb and Cr blocks
-    if ((x % (BLOCK_SIZE * state->subsample_factor) == 0) &&
-        (y % (BLOCK_SIZE * state->subsample_factor) == 0))
+// Transform nblocks consecutive 64-sample blocks
+static void fdct_islow_scalar(const uint8_t *samples, int16_t *coefs, size_t nblocks)
+{
+    for (size_t n = 0; n < nblocks; n++, samples += 64, coefs += 64)
     {
-        // Process Cb block
-        uint8_t cb_block[BLOCK_SIZE][BLOCK_SIZE];
-        for (int by = 0; by < BLOCK_SIZE; by++)
+        int32_t workspace[64];
+
+        for (int i = 0; i < 64; i++)
         {
-            for (int bx = 0; bx < BLOCK_SIZE; bx++)
-            {
-                int src_x = x / state->subsample_factor + bx;
-                int src_y = y / state->subsample_factor + by;
-                if (src_y < state->height && src_x < state->width)
-                {
-                    cb_block[by][bx] = state->ycbcr_data[src_y * state->width + src_x].cb;
-                }
-                else
-                {
-                    cb_block[by][bx] = cb_block[by - 1][bx - 1];
-                }
-            }
+            workspace[i] = samples[i] - 128;
         }
-
-        DctBlock cb_dct = apply_dct(cb_block);
-        quantize_block(&cb_dct, STD_QUANT_TABLE_C);
-
-        int cb_zigzag[BLOCK_SIZE * BLOCK_SIZE];
-        zigzag_scan(&cb_dct, cb_zigzag);
-
-        RLECode cb_codes[BLOCK_SIZE * BLOCK_SIZE];
-        int cb_code_count = run_length_encode(cb_zigzag, cb_codes);
-
-        huffman_encode_block(state, cb_codes, cb_code_count);
-
-        // Process Cr block
-        uint8_t cr_block[BLOCK_SIZE][BLOCK_SIZE];
-        for (int by = 0; by < BLOCK_SIZE; by++)
+        for (int row = 0; row < BLOCK_SIZE; row++)
         {
-            for (int bx = 0; bx < BLOCK_SIZE; bx++)
-            {
-                int src_x = x / state->subsample_factor + bx;
-                int src_y = y / state->subsample_factor + by;
-                if (src_y < state->height && src_x < state->width)
-                {
-                    cr_block[by][bx] = state->ycbcr_data[src_y * state->width + src_x].cr;
-                }
-                else
-                {
-                    cr_block[by][bx] = cr_block[by - 1][bx - 1];
-                }
-            }
+            fdct_islow_1d(&workspace[row * BLOCK_SIZE], 1, 1);
+        }
+        for (int col = 0; col < BLOCK_SIZE; col++)
+        {
+            fdct_islow_1d(&workspace[col], BLOCK_SIZE, 0);
+        }
+        for (int i = 0; i < 64; i++)
+        {
+            coefs[i] = (int16_t)workspace[i];
         }
-
-        DctBlock cr_dct = apply_dct(cr_block);
-        quantize_block(&cr_dct, STD_QUANT_TABLE_C);
-
-        int cr_zigzag[BLOCK_SIZE * BLOCK_SIZE];
-        zigzag_scan(&cr_dct, cr_zigzag);
-
-        RLECode cr_codes[BLOCK_SIZE * BLOCK_SIZE];
-        int cr_code_count = run_length_encode(cr_zigzag, cr_codes);
-
-        huffman_encode_block(state, cr_codes, cr_code_count);
     }
 }
 
-static YCbCr convert_rgb_to_ycbcr(RGB rgb)
+#ifdef JPEG_X86_SIMD
+// Vector form of fdct_islow_1d. V pastes the intrinsic prefix (_mm_ or
+// _mm256_) so SSE2 and AVX2 share one body; every operation is lane-local,
+// so with AVX2 each 128-bit lane carries its own block. The rotations are
+// regrouped into pmaddwd pairs, which is exact in integer arithmetic.
+#define ISLOW_PAIR(a, b) ((int32_t)(((uint32_t)(uint16_t)(b) << 16) | (uint16_t)(a)))
+
+#define ISLOW_ROTATE(V, VT, out_a, out_b, in_a, in_b, ca0, cb0, ca1, cb1, shift) \
+    do                                                                           \
+    {                                                                            \
+        const VT lo_ = V(unpacklo_epi16)(in_a, in_b);                            \
+        const VT hi_ = V(unpackhi_epi16)(in_a, in_b);                            \
+        const VT k0_ = V(set1_epi32)(ISLOW_PAIR(ca0, cb0));                      \
+        const VT k1_ = V(set1_epi32)(ISLOW_PAIR(ca1, cb1));                      \
+        const VT rnd_ = V(set1_epi32)(1 << ((shift) - 1));                       \
+        VT a_lo_ = V(add_epi32)(V(madd_epi16)(lo_, k0_), rnd_);                  \
+        VT a_hi_ = V(add_epi32)(V(madd_epi16)(hi_, k0_), rnd_);                  \
+        VT b_lo_ = V(add_epi32)(V(madd_epi16)(lo_, k1_), rnd_);                  \
+        VT b_hi_ = V(add_epi32)(V(madd_epi16)(hi_, k1_), rnd_);                  \
+        out_a = V(packs_epi32)(V(srai_epi32)(a_lo_, shift), V(srai_epi32)(a_hi_, shift)); \
+        out_b = V(packs_epi32)(V(srai_epi32)(b_lo_, shift), V(srai_epi32)(b_hi_, shift)); \
+    } while (0)
+
+// out = descale(in_a * ca + in_b * cb + z), with z given as 32-bit halves
+#define ISLOW_ROTATE_ADD(V, VT, out, in_a, in_b, ca, cb, z_lo, z_hi, shift)      \
+    do                                                                           \
+    {                                                                            \
+        const VT k_ = V(set1_epi32)(ISLOW_PAIR(ca, cb));                         \
+        const VT rnd_ = V(set1_epi32)(1 << ((shift) - 1));                       \
+        VT lo_ = V(madd_epi16)(V(unpacklo_epi16)(in_a, in_b), k_);               \
+        VT hi_ = V(madd_epi16)(V(unpackhi_epi16)(in_a, in_b), k_);               \
+        lo_ = V(add_epi32)(V(add_epi32)(lo_, z_lo), rnd_);                       \
+        hi_ = V(add_epi32)(V(add_epi32)(hi_, z_hi), rnd_);                       \
+        out = V(packs_epi32)(V(srai_epi32)(lo_, shift), V(srai_epi32)(hi_, shift)); \
+    } while (0)
+
+#define ISLOW_PASS(V, VT, d, first_pass)                                         \
+    do                                                                           \
+    {                                                                            \
+        const int shift_ = (first_pass) ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS    \
+                                        : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;   \
+        const VT tmp0 = V(add_epi16)(d[0], d[7]);                                \
+        const VT tmp7 = V(sub_epi16)(d[0], d[7]);                                \
+        const VT tmp1 = V(add_epi16)(d[1], d[6]);                                \
+        const VT tmp6 = V(sub_epi16)(d[1], d[6]);                                \
+        const VT tmp2 = V(add_epi16)(d[2], d[5]);                                \
+        const VT tmp5 = V(sub_epi16)(d[2], d[5]);                                \
+        const VT tmp3 = V(add_epi16)(d[3], d[4]);                                \
+        const VT tmp4 = V(sub_epi16)(d[3], d[4]);                                \
+                                                                                 \
+        /* Even part */                                                          \
+        const VT tmp10 = V(add_epi16)(tmp0, tmp3);                               \
+        const VT tmp13 = V(sub_epi16)(tmp0, tmp3);                               \
+        const VT tmp11 = V(add_epi16)(tmp1, tmp2);                               \
+        const VT tmp12 = V(sub_epi16)(tmp1, tmp2);                               \
+                                                                                 \
+        if (first_pass)                                                          \
+        {                                                                        \
+            d[0] = V(slli_epi16)(V(add_epi16)(tmp10, tmp11), ISLOW_PASS1_BITS);  \
+            d[4] = V(slli_epi16)(V(sub_epi16)(tmp10, tmp11), ISLOW_PASS1_BITS);  \
+        }                                                                        \
+        else                                                                     \
+        {                                                                        \
+            /* Rounding is added before the sign fix-up so -32768 can't wrap */  \
+            const VT rnd_ = V(set1_epi16)(1 << (ISLOW_PASS1_BITS - 1));          \
+            const VT sum_ = V(add_epi16)(tmp10, tmp11);                          \
+            const VT diff_ = V(sub_epi16)(tmp10, tmp11);                         \
+            d[0] = V(srai_epi16)(V(add_epi16)(V(add_epi16)(sum_, rnd_),          \
+                                              V(srai_epi16)(sum_, 15)),          \
+                                 ISLOW_PASS1_BITS);                              \
+            d[4] = V(srai_epi16)(V(add_epi16)(V(add_epi16)(diff_, rnd_),         \
+                                              V(srai_epi16)(diff_, 15)),         \
+                                 ISLOW_PASS1_BITS);                              \
+        }                                                                        \
+                                                                                 \
+        ISLOW_ROTATE(V, VT, d[2], d[6], tmp13, tmp12,                            \
+                     FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100,         \
+                     FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065, shift_); \
+                                                                                 \
+        /* Odd part: z3/z4 carry the shared FIX_1_175875602 term */              \
+        const VT z3 = V(add_epi16)(tmp4, tmp6);                                  \
+        const VT z4 = V(add_epi16)(tmp5, tmp7);                                  \
+        const VT z34_lo = V(unpacklo_epi16)(z3, z4);                             \
+        const VT z34_hi = V(unpackhi_epi16)(z3, z4);                             \
+        const VT k3_ = V(set1_epi32)(ISLOW_PAIR(FIX_1_175875602 - FIX_1_961570560, \
+                                                FIX_1_175875602));               \
+        const VT k4_ = V(set1_epi32)(ISLOW_PAIR(FIX_1_175875602,                 \
+                                                FIX_1_175875602 - FIX_0_390180644)); \
+        const VT z3_lo = V(madd_epi16)(z34_lo, k3_);                             \
+        const VT z3_hi = V(madd_epi16)(z34_hi, k3_);                             \
+        const VT z4_lo = V(madd_epi16)(z34_lo, k4_);                             \
+        const VT z4_hi = V(madd_epi16)(z34_hi, k4_);                             \
+                                                                                 \
+        ISLOW_ROTATE_ADD(V, VT, d[7], tmp4, tmp7,                                \
+                         FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223,    \
+                         z3_lo, z3_hi, shift_);                                  \
+        ISLOW_ROTATE_ADD(V, VT, d[1], tmp4, tmp7,                                \
+                         -FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223,    \
+                         z4_lo, z4_hi, shift_);                                  \
+        ISLOW_ROTATE_ADD(V, VT, d[5], tmp5, tmp6,                                \
+                         FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447,    \
+                         z4_lo, z4_hi, shift_);                                  \
+        ISLOW_ROTATE_ADD(V, VT, d[3], tmp5, tmp6,                                \
+                         -FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447,    \
+                         z3_lo, z3_hi, shift_);                                  \
+    } while (0)
+
+// 8x8 int16 transpose within each 128-bit lane
+#define ISLOW_TRANSPOSE(V, VT, r)                                                \
+    do                                                                           \
+    {                                                                            \
+        const VT t0 = V(unpacklo_epi16)(r[0], r[1]);                             \
+        const VT t1 = V(unpackhi_epi16)(r[0], r[1]);                             \
+        const VT t2 = V(unpacklo_epi16)(r[2], r[3]);                             \
+        const VT t3 = V(unpackhi_epi16)(r[2], r[3]);                             \
+        const VT t4 = V(unpacklo_epi16)(r[4], r[5]);                             \
+        const VT t5 = V(unpackhi_epi16)(r[4], r[5]);                             \
+        const VT t6 = V(unpacklo_epi16)(r[6], r[7]);                             \
+        const VT t7 = V(unpackhi_epi16)(r[6], r[7]);                             \
+        const VT u0 = V(unpacklo_epi32)(t0, t2);                                 \
+        const VT u1 = V(unpackhi_epi32)(t0, t2);                                 \
+        const VT u2 = V(unpacklo_epi32)(t1, t3);                                 \
+        const VT u3 = V(unpackhi_epi32)(t1, t3);                                 \
+        const VT u4 = V(unpacklo_epi32)(t4, t6);                                 \
+        const VT u5 = V(unpackhi_epi32)(t4, t6);                                 \
+        const VT u6 = V(unpacklo_epi32)(t5, t7);                                 \
+        const VT u7 = V(unpackhi_epi32)(t5, t7);                                 \
+        r[0] = V(unpacklo_epi64)(u0, u4);                                        \
+        r[1] = V(unpackhi_epi64)(u0, u4);                                        \
+        r[2] = V(unpacklo_epi64)(u1, u5);                                        \
+        r[3] = V(unpackhi_epi64)(u1, u5);                                        \
+        r[4] = V(unpacklo_epi64)(u2, u6);                                        \
+        r[5] = V(unpackhi_epi64)(u2, u6);                                        \
+        r[6] = V(unpacklo_epi64)(u3, u7);                                        \
+        r[7] = V(unpackhi_epi64)(u3, u7);                                        \
+    } while (0)
+
+#define ISLOW_SSE2(op) _mm_##op
+
+// One block per iteration: rows -> transpose -> pass 1 -> transpose -> pass 2
+TARGET_SSE2 static void fdct_islow_sse2(const uint8_t *samples, int16_t *coefs, size_t nblocks)
 {
-    YCbCr ycbcr;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i center = _mm_set1_epi16(128);
 
-    // Using BT.601 conversion
-    ycbcr.y = (uint8_t)(0.299 * rgb.r + 0.587 * rgb.g + 0.114 * rgb.b);
-    ycbcr.cb = (uint8_t)(-0.169 * rgb.r - 0.331 * rgb.g + 0.500 * rgb.b + 128);
-    ycbcr.cr = (uint8_t)(0.500 * rgb.r - 0.419 * rgb.g - 0.081 * rgb.b + 128);
+    for (size_t n = 0; n < nblocks; n++, samples += 64, coefs += 64)
+    {
+        __m128i r[8];
+        for (int i = 0; i < 8; i++)
+        {
+            const __m128i row = _mm_loadl_epi64((const __m128i *)(samples + i * 8));
+            r[i] = _mm_sub_epi16(_mm_unpacklo_epi8(row, zero), center);
+        }
 
-    return ycbcr;
+        ISLOW_TRANSPOSE(ISLOW_SSE2, __m128i, r);
+        ISLOW_PASS(ISLOW_SSE2, __m128i, r, 1);
+        ISLOW_TRANSPOSE(ISLOW_SSE2, __m128i, r);
+        ISLOW_PASS(ISLOW_SSE2, __m128i, r, 0);
+
+        for (int i = 0; i < 8; i++)
+        {
+            _mm_storeu_si128((__m128i *)(coefs + i * 8), r[i]);
+        }
+    }
 }
 
-static void apply_chroma_subsampling(JpegState *state)
+#define ISLOW_AVX2(op) _mm256_##op
+
+// Two blocks per iteration, one in each 128-bit lane
+TARGET_AVX2 static void fdct_islow_avx2(const uint8_t *samples, int16_t *coefs, size_t nblocks)
 {
-    const int factor = state->subsample_factor;
+    const __m256i center = _mm256_set1_epi16(128);
+    size_t n = 0;
 
-    for (uint32_t y = 0; y < state->height; y += factor)
+    for (; n + 2 <= nblocks; n += 2, samples += 128, coefs += 128)
     {
-        for (uint32_t x = 0; x < state->width; x += factor)
+        __m256i r[8];
+        for (int i = 0; i < 8; i++)
         {
-            // Calculate average Cb and Cr for the block
-            int sum_cb = 0, sum_cr = 0, count = 0;
-
-            for (int dy = 0; dy < factor && (y + dy) < state->height; dy++)
-            {
-                for (int dx = 0; dx < factor && (x + dx) < state->width; dx++)
-                {
-                    const uint32_t idx = (y + dy) * state->width + (x + dx);
-                    sum_cb += state->ycbcr_data[idx].cb;
-                    sum_cr += state->ycbcr_data[idx].cr;
-                    count++;
-                }
-            }
+            const __m128i pair = _mm_unpacklo_epi64(
+                _mm_loadl_epi64((const __m128i *)(samples + i * 8)),
+                _mm_loadl_epi64((const __m128i *)(samples + 64 + i * 8)));
+            r[i] = _mm256_sub_epi16(_mm256_cvtepu8_epi16(pair), center);
+        }
 
-            // Apply averages back to the block
-            const uint8_t avg_cb = sum_cb / count;
-            const uint8_t avg_cr = sum_cr / count;
+        ISLOW_TRANSPOSE(ISLOW_AVX2, __m256i, r);
+        ISLOW_PASS(ISLOW_AVX2, __m256i, r, 1);
+        ISLOW_TRANSPOSE(ISLOW_AVX2, __m256i, r);
+        ISLOW_PASS(ISLOW_AVX2, __m256i, r, 0);
 
-            for (int dy = 0; dy < factor && (y + dy) < state->height; dy++)
-            {
-                for (int dx = 0; dx < factor && (x + dx) < state->width; dx++)
-                {
-                    const uint32_t idx = (y + dy) * state->width + (x + dx);
-                    state->ycbcr_data[idx].cb = avg_cb;
-                    state->ycbcr_data[idx].cr = avg_cr;
-                }
-            }
+        for (int i = 0; i < 8; i++)
+        {
+            _mm_storeu_si128((__m128i *)(coefs + i * 8), _mm256_castsi256_si128(r[i]));
+            _mm_storeu_si128((__m128i *)(coefs + 64 + i * 8), _mm256_extracti128_si256(r[i], 1));
         }
     }
+
+    if (n < nblocks)
+    {
+        fdct_islow_sse2(samples, coefs, nblocks - n);
+    }
 }
+#endif
 
-// Initialize quantization tables with quality scaling
-static void init_quantization_tables(JpegState *state)
+// Transform nblocks 64-sample blocks into int16 coefficients scaled by 8.
+// The floating-point methods run per block and are rounded into the same
+// representation so everything downstream sees one coefficient format.
+static void forward_dct_blocks(const JpegState *state, const uint8_t *samples,
+                               int16_t *coefs, size_t nblocks)
 {
-    double quality_scale;
-    if (state->quality < 50)
-        quality_scale = 50.0 / state->quality;
-    else
-        quality_scale = 2.0 - ((double)state->quality / 50.0);
+    if (state->dct_method == DCT_INT)
+    {
+        state->kernels->fdct_islow(samples, coefs, nblocks);
+        return;
+    }
 
-    // Scale luminance quantization table
-    for (int i = 0; i < BLOCK_SIZE; i++)
+    for (size_t n = 0; n < nblocks; n++, samples += 64, coefs += 64)
     {
-        for (int j = 0; j < BLOCK_SIZE; j++)
+        const DctBlock dct = forward_dct(state, (const uint8_t(*)[BLOCK_SIZE])samples);
+        for (int i = 0; i < 64; i++)
         {
-            int value = (int)(STD_QUANT_TABLE_Y[i][j] * quality_scale);
-            state->quant_table_y[i * BLOCK_SIZE + j] =
-                (uint8_t)CLAMP(value, 1, 255);
+            coefs[i] = (int16_t)lround(dct.data[i / BLOCK_SIZE][i % BLOCK_SIZE] * 8.0);
         }
     }
+}
 
-    // Scale chrominance quantization table
-    for (int i = 0; i < BLOCK_SIZE; i++)
+// Reference quantizer on double blocks; the encoder uses quantize_zigzag
+void quantize_block(DctBlock *dct, const uint8_t quant_table[BLOCK_SIZE][BLOCK_SIZE])
+{
+    for (int u = 0; u < BLOCK_SIZE; u++)
     {
-        for (int j = 0; j < BLOCK_SIZE; j++)
+        for (int v = 0; v < BLOCK_SIZE; v++)
         {
-            int value = (int)(STD_QUANT_TABLE_C[i][j] * quality_scale);
-            state->quant_table_c[i * BLOCK_SIZE + j] =
-                (uint8_t)CLAMP(value, 1, 255);
+            dct->data[u][v] = round(dct->data[u][v] / quant_table[u][v]);
         }
     }
 }
 
-void jpeg_cleanup(JpegState *state)
+const int ZIGZAG_PATTERN[64][2] = {
+    {0, 0}, {0, 1}, {1, 0}, {2, 0}, {1, 1}, {0, 2}, {0, 3}, {1, 2}, {2, 1}, {3, 0}, {4, 0}, {3, 1}, {2, 2}, {1, 3}, {0, 4}, {0, 5}, {1, 4}, {2, 3}, {3, 2}, {4, 1}, {5, 0}, {6, 0}, {5, 1}, {4, 2}, {3, 3}, {2, 4}, {1, 5}, {0, 6}, {0, 7}, {1, 6}, {2, 5}, {3, 4}, {4, 3}, {5, 2}, {6, 1}, {7, 0}, {7, 1}, {6, 2}, {5, 3}, {4, 4}, {3, 5}, {2, 6}, {1, 7}, {2, 7}, {3, 6}, {4, 5}, {5, 4}, {6, 3}, {7, 2}, {7, 3}, {6, 4}, {5, 5}, {4, 6}, {3, 7}, {4, 7}, {5, 6}, {6, 5}, {7, 4}, {7, 5}, {6, 6}, {5, 7}, {6, 7}, {7, 6}, {7, 7}};
+
+void zigzag_scan(const DctBlock *dct, int output[BLOCK_SIZE * BLOCK_SIZE])
 {
-    if (!state)
-        return;
 
-    if (state->output_buffer)
-    {
-        free(state->output_buffer);
-        state->output_buffer = NULL;
-    }
-    if (state->rgb_data)
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        free(state->rgb_data);
-        state->rgb_data = NULL;
+        int row = ZIGZAG_PATTERN[i][0];
+        int col = ZIGZAG_PATTERN[i][1];
+        output[i] = (int)dct->data[row][col];
     }
-    if (state->ycbcr_data)
+}
+
+// Natural (row-major) index of each zigzag position
+static const uint8_t ZIGZAG_ORDER[BLOCK_SIZE * BLOCK_SIZE] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63};
+
+// Build the reciprocal of one divisor (libjpeg-turbo's compute_reciprocal).
+// For divisors up to 2040 and |c| < 32768 the result equals
+// (|c| + divisor / 2) / divisor exactly, so no divide is needed per block.
+static void compute_reciprocal(uint16_t divisor, QuantDivisors *div, int i)
+{
+    const int b = 31 - __builtin_clz(divisor);
+    int r = 16 + b;
+    uint32_t fq = (1u << r) / divisor;
+    const uint32_t fr = (1u << r) % divisor;
+    uint16_t c = divisor / 2;
+
+    if (fr == 0)
     {
-        free(state->ycbcr_data);
-        state->ycbcr_data = NULL;
+        // Power of two: the reciprocal is exact at one bit less
+        fq >>= 1;
+        r--;
     }
-    if (state->quant_table_y)
+    else if (fr <= divisor / 2u)
     {
-        free(state->quant_table_y);
-        state->quant_table_y = NULL;
+        c++;
     }
-    if (state->quant_table_c)
+    else
     {
-        free(state->quant_table_c);
-        state->quant_table_c = NULL;
+        fq++;
     }
 
-    if (state->outfile)
+    div->recip[i] = (uint16_t)fq;
+    div->corr[i] = c;
+    div->scale[i] = (uint16_t)(1u << (32 - r)); // Divisors of at least 8 keep r at 18 or more
+    div->shift[i] = (uint8_t)r;
+}
+
+static void init_quant_divisors(const uint8_t *quant_table, QuantDivisors *div)
+{
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        fclose(state->outfile);
-        state->outfile = NULL;
+        compute_reciprocal((uint16_t)(quant_table[ZIGZAG_ORDER[i]] * 8), div, i);
     }
-
-    free(state);
 }
 
-// Initialize JPEG compression state
-JpegState *jpeg_init(uint32_t width, uint32_t height, uint8_t quality)
+// Fused quantization and zigzag scan: reads DCT coefficients (natural order,
+// scaled by 8) and writes quantized values in zigzag order in one pass
+static void quantize_zigzag_scalar(const int16_t coefs[BLOCK_SIZE * BLOCK_SIZE],
+                                   const QuantDivisors *div, int16_t output[BLOCK_SIZE * BLOCK_SIZE])
 {
-    // Validate input parameters
-    if (width == 0 || height == 0 || width > 65535 || height > 65535)
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        return NULL;
+        const int16_t c = coefs[ZIGZAG_ORDER[i]];
+        uint32_t magnitude = (uint32_t)(c < 0 ? -c : c);
+        magnitude = ((magnitude + div->corr[i]) * div->recip[i]) >> div->shift[i];
+        output[i] = c < 0 ? -(int16_t)magnitude : (int16_t)magnitude;
     }
+}
 
-    // Quality should be between 1 and 100
-    if (quality < 1 || quality > 100)
+#ifdef JPEG_X86_SIMD
+// The vector kernels gather the block into zigzag order first, then
+// quantize as libjpeg-turbo does: pmulhuw by recip drops the low 16 bits
+// of the shift and pmulhuw by scale the rest. |c| + corr stays below
+// 65536 and both steps truncate, so the results match the scalar kernel.
+TARGET_SSSE3 static void quantize_zigzag_ssse3(const int16_t coefs[BLOCK_SIZE * BLOCK_SIZE],
+                                               const QuantDivisors *div,
+                                               int16_t output[BLOCK_SIZE * BLOCK_SIZE])
+{
+    int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE];
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        quality = 75; // Default quality
+        zigzag[i] = coefs[ZIGZAG_ORDER[i]];
     }
 
-    JpegState *state = calloc(1, sizeof(JpegState));
-    if (!state)
-        return NULL;
-
-    state->width = width;
-    state->height = height;
-    state->quality = quality;
-    state->subsample_factor = 2; // 4:2:0 subsampling
-
-    // Calculate buffer sizes with overflow protection
-    size_t pixel_count = (size_t)width * height;
-    if (pixel_count / width != height)
-    { // Check for overflow
-        free(state);
-        return NULL;
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i += 8)
+    {
+        const __m128i c = _mm_loadu_si128((const __m128i *)(zigzag + i));
+        const __m128i corr = _mm_loadu_si128((const __m128i *)(div->corr + i));
+        const __m128i recip = _mm_loadu_si128((const __m128i *)(div->recip + i));
+        const __m128i scale = _mm_loadu_si128((const __m128i *)(div->scale + i));
+        const __m128i magnitude = _mm_mulhi_epu16(_mm_mulhi_epu16(_mm_add_epi16(_mm_abs_epi16(c), corr), recip), scale);
+        _mm_storeu_si128((__m128i *)(output + i), _mm_sign_epi16(magnitude, c));
     }
+}
 
-    // Initial buffer size estimation (conservative)
-    state->buffer_size = pixel_count * 3; // Roughly 3 bytes per pixel
-
-    // Allocate all required buffers
-    state->output_buffer = malloc(width * height * 3);
-    if (!state->output_buffer)
-        goto cleanup;
-
-    state->rgb_data = malloc(width * height * sizeof(RGB));
-    if (!state->rgb_data)
-        goto cleanup;
-
-    state->ycbcr_data = malloc(width * height * sizeof(YCbCr));
-    if (!state->ycbcr_data)
-        goto cleanup;
-
-    state->quant_table_y = malloc(BLOCK_SIZE * BLOCK_SIZE);
-    if (!state->quant_table_y)
-        goto cleanup;
-
-    state->quant_table_c = malloc(BLOCK_SIZE * BLOCK_SIZE);
-    if (!state->quant_table_c)
-        goto cleanup;
-
-    if (!state->output_buffer || !state->rgb_data || !state->ycbcr_data ||
-        !state->quant_table_y || !state->quant_table_c)
+TARGET_AVX2 static void quantize_zigzag_avx2(const int16_t coefs[BLOCK_SIZE * BLOCK_SIZE],
+                                             const QuantDivisors *div,
+                                             int16_t output[BLOCK_SIZE * BLOCK_SIZE])
+{
+    int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE];
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
     {
-        jpeg_cleanup(state);
-        return NULL;
+        zigzag[i] = coefs[ZIGZAG_ORDER[i]];
     }
 
-    // Initialize quantization tables with quality scaling
-    init_quantization_tables(state);
-
-    // Initialize Huffman tables
-    if (init_huffman_tables(state) != 0)
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i += 16)
     {
-        jpeg_cleanup(state);
-        return NULL;
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(zigzag + i));
+        const __m256i corr = _mm256_loadu_si256((const __m256i *)(div->corr + i));
+        const __m256i recip = _mm256_loadu_si256((const __m256i *)(div->recip + i));
+        const __m256i scale = _mm256_loadu_si256((const __m256i *)(div->scale + i));
+        const __m256i magnitude =
+            _mm256_mulhi_epu16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_abs_epi16(c), corr), recip), scale);
+        _mm256_storeu_si256((__m256i *)(output + i), _mm256_sign_epi16(magnitude, c));
     }
-
-    return state;
-
-cleanup:
-    jpeg_cleanup(state);
-    return NULL;
 }
+#endif
 
-// Write Start of Frame
-void write_sof0(JpegState *state)
-{
-    write_marker(state, MARKER_SOF0);
-    write_word(state, 17); // Length
-    write_byte(state, 8);  // Precision
-    write_word(state, state->height);
-    write_word(state, state->width);
-    write_byte(state, 3); // Number of components
-
-    // Y component
-    write_byte(state, 1);    // Component ID
-    write_byte(state, 0x22); // Sampling factors (2x2)
-    write_byte(state, 0);    // Quant table ID
+// compression pipeline
+#define MAX_BLOCKS_PER_MCU 10
 
-    // Cb component
-    write_byte(state, 2);    // Component ID
-    write_byte(state, 0x11); // Sampling factors (1x1)
-    write_byte(state, 1);    // Quant table ID
+// Luma sampling factors of each chroma layout; chroma is always 1x1
+static const uint8_t LAYOUT_H_FACTOR[] = {[CHROMA_444] = 1, [CHROMA_422] = 2, [CHROMA_420] = 2};
+static const uint8_t LAYOUT_V_FACTOR[] = {[CHROMA_444] = 1, [CHROMA_422] = 1, [CHROMA_420] = 2};
 
-    // Cr component
-    write_byte(state, 3);    // Component ID
-    write_byte(state, 0x11); // Sampling factors (1x1)
-    write_byte(state, 1);    // Quant table ID
+// MCU geometry. A grayscale image is a single non-interleaved component
+// whose MCU is one 8x8 block; a colour MCU holds h x v Y blocks in raster
+// order followed by one Cb and one Cr block.
+static inline uint32_t mcu_h_factor(const JpegState *state)
+{
+    return state->num_components == 1 ? 1 : LAYOUT_H_FACTOR[state->chroma_layout];
 }
 
-// Write quantization tables
-void write_dqt(JpegState *state)
+static inline uint32_t mcu_v_factor(const JpegState *state)
 {
-    // Write marker and length
-    write_marker(state, MARKER_DQT);
-    write_word(state, 2 + (2 * (1 + 64))); // Length
-
-    // Write luminance table
-    write_byte(state, 0x00); // Table ID 0, precision 8-bit
-    for (int i = 0; i < 64; i++)
-    {
-        write_byte(state, state->quant_table_y[ZIGZAG_PATTERN[i][0] * 8 +
-                                               ZIGZAG_PATTERN[i][1]]);
-    }
-
-    // Write chrominance table
-    write_byte(state, 0x01); // Table ID 1, precision 8-bit
-    for (int i = 0; i < 64; i++)
-    {
-        write_byte(state, state->quant_table_c[ZIGZAG_PATTERN[i][0] * 8 +
-                                               ZIGZAG_PATTERN[i][1]]);
-    }
+    return state->num_components == 1 ? 1 : LAYOUT_V_FACTOR[state->chroma_layout];
 }
 
-// Write JPEG file header
-void write_jpeg_header(JpegState *state)
+static inline uint32_t mcu_width_of(const JpegState *state)
 {
-    // Write SOI marker
-    write_marker(state, MARKER_SOI);
-
-    // Write JFIF APP0 marker
-    write_app0(state);
-
-    // Write quantization tables
-    write_dqt(state);
+    return BLOCK_SIZE * mcu_h_factor(state);
+}
 
-    // Write Start of Frame
-    write_sof0(state);
+static inline uint32_t mcu_height_of(const JpegState *state)
+{
+    return BLOCK_SIZE * mcu_v_factor(state);
+}
 
-    // Write Huffman tables
-    write_dht(state);
+static inline uint32_t mcu_cols_of(const JpegState *state)
+{
+    return (state->width + mcu_width_of(state) - 1) / mcu_width_of(state);
+}
 
-    // Write Start of Scan
-    write_sos(state);
+static inline uint32_t mcu_rows_of(const JpegState *state)
+{
+    return (state->height + mcu_height_of(state) - 1) / mcu_height_of(state);
 }
 
-// Write JPEG file trailer
-void write_jpeg_trailer(JpegState *state)
+static inline int mcu_luma_blocks(const JpegState *state)
 {
-    // Write End of Image marker
-    fwrite("\xFF\xD9", 1, 2, state->outfile);
+    return (int)(mcu_h_factor(state) * mcu_v_factor(state));
 }
 
-// Main compression function
-// Main compression function enhancement
-int jpeg_compress(JpegState *state, const char *output_filename)
+static inline int mcu_block_count(const JpegState *state)
 {
-    if (!state || !output_filename)
-        return -1;
+    return mcu_luma_blocks(state) + state->num_components - 1;
+}
 
-    // Open output file
-    state->outfile = fopen(output_filename, "wb");
-    if (!state->outfile)
-        return -1;
+// DCT-domain previews: while the main image is transformed, every 8x8
+// block also yields an m x m block of a 1/2, 1/4 or 1/8 scale image
+// (m = 4, 2, 1) by an m-point inverse DCT of its m x m lowest frequencies;
+// at 1/8 that is just the DC term. The reduced blocks land in planes laid
+// out like the main image's MCU grid, Y first, then Cb and Cr at the
+// chroma layout's resolution. Scale index k selects 1/2, 1/4 or 1/8.
+static const float PREVIEW_BASIS_4[4][4] = { // C(u) cos((2x + 1) u pi / 8), [x][u]
+    {0.70710678f, 0.92387953f, 0.70710678f, 0.38268343f},
+    {0.70710678f, 0.38268343f, -0.70710678f, -0.92387953f},
+    {0.70710678f, -0.38268343f, -0.70710678f, 0.92387953f},
+    {0.70710678f, -0.92387953f, 0.70710678f, -0.38268343f},
+};
+
+static const float PREVIEW_BASIS_2[2][2] = { // C(u) cos((2x + 1) u pi / 4), [x][u]
+    {0.70710678f, 0.70710678f},
+    {0.70710678f, -0.70710678f},
+};
+
+static size_t preview_planes_size(const JpegState *state, int k)
+{
+    const uint32_t m = 4 >> k;
+    const size_t luma = (size_t)mcu_cols_of(state) * mcu_h_factor(state) * m * mcu_rows_of(state) * mcu_v_factor(state) * m;
+    const size_t chroma = (size_t)mcu_cols_of(state) * m * mcu_rows_of(state) * m;
+    return luma + (state->num_components - 1) * chroma;
+}
 
-    // Initialize compression state
-    state->bit_buffer = 0;
-    state->bits_in_buffer = 0;
-    state->last_dc_y = 0;
-    state->last_dc_cb = 0;
-    state->last_dc_cr = 0;
+static uint8_t *preview_plane(const JpegState *state, int k, int component, uint32_t *stride)
+{
+    const uint32_t m = 4 >> k;
+    const uint32_t luma_stride = mcu_cols_of(state) * mcu_h_factor(state) * m;
+    const uint32_t chroma_stride = mcu_cols_of(state) * m;
+    const size_t luma_size = (size_t)luma_stride * mcu_rows_of(state) * mcu_v_factor(state) * m;
+    const size_t chroma_size = (size_t)chroma_stride * mcu_rows_of(state) * m;
+
+    *stride = component ? chroma_stride : luma_stride;
+    return state->preview_planes[k] + (component ? luma_size + (component - 1) * chroma_size : 0);
+}
 
-    // Write JPEG headers
-    write_jpeg_header(state);
+static void free_previews(JpegState *state)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        free(state->preview_planes[k]);
+        state->preview_planes[k] = NULL;
+    }
+}
 
-    // Convert colorspace and apply subsampling
-    for (uint32_t i = 0; i < state->width * state->height; i++)
+// The DCT output is 8x the JPEG definition, whose m-point reduction
+// carries another m / 8, so the scaled inverse divides by 32 for any m
+static void reduce_block(const int16_t coefs[BLOCK_SIZE * BLOCK_SIZE], uint32_t m, uint8_t *out,
+                         uint32_t stride)
+{
+    if (m == 1)
     {
-        state->ycbcr_data[i] = convert_rgb_to_ycbcr(state->rgb_data[i]);
+        const int value = 128 + (coefs[0] + (coefs[0] >= 0 ? 32 : -32)) / 64;
+        *out = (uint8_t)CLAMP(value, 0, 255);
+        return;
     }
-    apply_chroma_subsampling(state);
 
-    // Process MCUs
-    for (uint32_t y = 0; y < state->height; y += BLOCK_SIZE)
+    const float *basis = m == 4 ? &PREVIEW_BASIS_4[0][0] : &PREVIEW_BASIS_2[0][0];
+    float rows[4][4];
+    for (uint32_t v = 0; v < m; v++)
     {
-        for (uint32_t x = 0; x < state->width; x += BLOCK_SIZE)
+        for (uint32_t x = 0; x < m; x++)
         {
-            process_mcu(state, x, y);
+            float sum = 0.0f;
+            for (uint32_t u = 0; u < m; u++)
+            {
+                sum += coefs[v * BLOCK_SIZE + u] * basis[x * m + u];
+            }
+            rows[v][x] = sum;
         }
     }
-
-    // Flush remaining bits
-    if (state->bits_in_buffer > 0)
+    for (uint32_t y = 0; y < m; y++)
     {
-        write_byte(state, state->bit_buffer << (8 - state->bits_in_buffer));
+        for (uint32_t x = 0; x < m; x++)
+        {
+            float sum = 0.0f;
+            for (uint32_t v = 0; v < m; v++)
+            {
+                sum += rows[v][x] * basis[y * m + v];
+            }
+            const int value = (int)lrintf(sum * (1.0f / 32) + 128.0f);
+            out[y * stride + x] = (uint8_t)CLAMP(value, 0, 255);
+        }
     }
+}
 
-    // Write JPEG trailer
-    write_jpeg_trailer(state);
+// Reduce the transformed MCU at (col, row) into every preview being built
+static void reduce_mcu(const JpegState *state, uint32_t row, uint32_t col,
+                       const int16_t (*coefs)[BLOCK_SIZE * BLOCK_SIZE])
+{
+    const uint32_t h = mcu_h_factor(state);
+    const uint32_t v = mcu_v_factor(state);
 
-    // Write all buffered data to file
-    fwrite(state->output_buffer, 1, state->buffer_position, state->outfile);
+    for (int k = 0; k < 3; k++)
+    {
+        if (!state->preview_planes[k])
+            continue;
 
-    return 0;
+        const uint32_t m = 4 >> k;
+        uint32_t stride;
+        uint8_t *plane = preview_plane(state, k, 0, &stride);
+        for (uint32_t by = 0; by < v; by++)
+        {
+            for (uint32_t bx = 0; bx < h; bx++)
+            {
+                reduce_block(coefs[by * h + bx], m, plane + (size_t)(row * v + by) * m * stride + (col * h + bx) * m,
+                             stride);
+            }
+        }
+        for (int c = 1; c < state->num_components; c++)
+        {
+            plane = preview_plane(state, k, c, &stride);
+            reduce_block(coefs[h * v + c - 1], m, plane + (size_t)row * m * stride + col * m, stride);
+        }
+    }
 }
 
-// Function to decode a JPEG image into an RGB array
-RGB *read_jpeg(const char *filename, uint32_t *width, uint32_t *height)
+// Copy the 8x8 block at (x, y) of a strip plane. Planes are padded to
+// whole MCUs by edge replication, so no bounds checks are needed.
+static void extract_block(const uint8_t *plane, uint32_t stride, uint32_t x, uint32_t y,
+                          uint8_t *block)
 {
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    FILE *infile = fopen(filename, "rb");
-    if (!infile)
+    const uint8_t *src = plane + (size_t)y * stride + x;
+    for (int by = 0; by < BLOCK_SIZE; by++, src += stride)
     {
-        fprintf(stderr, "Error: Could not open file %s\n", filename);
-        return NULL;
+        memcpy(block + by * BLOCK_SIZE, src, BLOCK_SIZE);
     }
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
+// Transform the MCU at column x of the strip into natural-order DCT
+// blocks, and analyze it: transform and quantize it into zigzag ordered
+// blocks, laid out as described at mcu_width_of. Each layout gets its own
+// copy with the sampling factors fixed at compile time, so the block loops
+// unroll and nothing is decided per block. All blocks of the MCU go
+// through the DCT in a single call so the SIMD kernels can work on several
+// at once.
+typedef void (*AnalyzeMcuFn)(const JpegState *state, const StripBuffers *strip, uint32_t x,
+                             int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE]);
+
+#define DEFINE_ANALYZE_MCU(name, H, V, CHROMA)                                                         \
+    static void transform_mcu_##name(const JpegState *state, const StripBuffers *strip, uint32_t x,   \
+                                     int16_t (*coefs)[BLOCK_SIZE * BLOCK_SIZE])                       \
+    {                                                                                                  \
+        enum { LUMA = (H) * (V), COUNT = LUMA + 2 * (CHROMA) };                                        \
+        uint8_t samples[COUNT][BLOCK_SIZE * BLOCK_SIZE];                                               \
+                                                                                                       \
+        for (int by = 0; by < (V); by++)                                                               \
+        {                                                                                              \
+            for (int bx = 0; bx < (H); bx++)                                                           \
+            {                                                                                          \
+                extract_block(strip->plane_y, strip->stride_y, x + bx * BLOCK_SIZE, by * BLOCK_SIZE,   \
+                              samples[by * (H) + bx]);                                                 \
+            }                                                                                          \
+        }                                                                                              \
+        if (CHROMA)                                                                                    \
+        {                                                                                              \
+            /* Chroma planes are already at the subsampled size */                                     \
+            extract_block(strip->plane_cb, strip->stride_c, x / (H), 0, samples[LUMA]);                \
+            extract_block(strip->plane_cr, strip->stride_c, x / (H), 0, samples[LUMA + (CHROMA)]);     \
+        }                                                                                              \
+                                                                                                       \
+        forward_dct_blocks(state, samples[0], coefs[0], COUNT);                                        \
+        if (state->preview_count)                                                                      \
+            reduce_mcu(state, strip->mcu_row, x / ((H) * BLOCK_SIZE),                                  \
+                       (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])coefs);                             \
+    }                                                                                                  \
+                                                                                                       \
+    static void analyze_mcu_##name(const JpegState *state, const StripBuffers *strip, uint32_t x,     \
+                                   int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE])                        \
+    {                                                                                                  \
+        enum { LUMA = (H) * (V), COUNT = LUMA + 2 * (CHROMA) };                                        \
+        int16_t coefs[COUNT][BLOCK_SIZE * BLOCK_SIZE];                                                 \
+        transform_mcu_##name(state, strip, x, coefs);                                                  \
+                                                                                                       \
+        /* Quantize straight into zigzag order */                                                      \
+        for (int i = 0; i < LUMA; i++)                                                                 \
+        {                                                                                              \
+            state->kernels->quantize_zigzag(coefs[i], &state->divisors_y, blocks[i]);                  \
+        }                                                                                              \
+        for (int i = LUMA; i < COUNT; i++)                                                             \
+        {                                                                                              \
+            state->kernels->quantize_zigzag(coefs[i], &state->divisors_c, blocks[i]);                  \
+        }                                                                                              \
+    }
+
+DEFINE_ANALYZE_MCU(gray, 1, 1, 0)
+DEFINE_ANALYZE_MCU(444, 1, 1, 1)
+DEFINE_ANALYZE_MCU(422, 2, 1, 1)
+DEFINE_ANALYZE_MCU(420, 2, 2, 1)
+
+static const AnalyzeMcuFn ANALYZE_MCU[] = {
+    [CHROMA_444] = analyze_mcu_444,
+    [CHROMA_422] = analyze_mcu_422,
+    [CHROMA_420] = analyze_mcu_420,
+};
+
+static const AnalyzeMcuFn TRANSFORM_MCU[] = {
+    [CHROMA_444] = transform_mcu_444,
+    [CHROMA_422] = transform_mcu_422,
+    [CHROMA_420] = transform_mcu_420,
+};
+
+static inline void analyze_mcu(const JpegState *state, const StripBuffers *strip, uint32_t x,
+                               int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE])
+{
+    const AnalyzeMcuFn analyze = state->num_components == 1 ? analyze_mcu_gray : ANALYZE_MCU[state->chroma_layout];
+    analyze(state, strip, x, blocks);
+}
+
+static inline void transform_mcu(const JpegState *state, const StripBuffers *strip, uint32_t x,
+                                 int16_t (*coefs)[BLOCK_SIZE * BLOCK_SIZE])
+{
+    const AnalyzeMcuFn transform = state->num_components == 1 ? transform_mcu_gray : TRANSFORM_MCU[state->chroma_layout];
+    transform(state, strip, x, coefs);
+}
+
+// Run-length and Huffman encode an MCU produced by analyze_mcu
+static void encode_mcu(const JpegState *state, JpegWriter *writer,
+                       const int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE])
+{
+    const int luma_blocks = mcu_luma_blocks(state);
+    for (int i = 0; i < luma_blocks; i++)
+    {
+        huffman_encode_block(writer, blocks[i], &writer->last_dc[0], &state->dc_table_y, &state->ac_table_y);
+    }
+    if (state->num_components == 1)
+        return;
+    huffman_encode_block(writer, blocks[luma_blocks], &writer->last_dc[1], &state->dc_table_c, &state->ac_table_c);
+    huffman_encode_block(writer, blocks[luma_blocks + 1], &writer->last_dc[2], &state->dc_table_c, &state->ac_table_c);
+}
+
+// Encode the MCU at column x of the current strip
+static void process_mcu(const JpegState *state, const StripBuffers *strip, JpegWriter *writer,
+                        uint32_t x)
+{
+    int16_t blocks[MAX_BLOCKS_PER_MCU][BLOCK_SIZE * BLOCK_SIZE];
+    analyze_mcu(state, strip, x, blocks);
+    encode_mcu(state, writer, (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])blocks);
+}
+
+// Reference per-pixel conversion; the encoder uses rgb_to_ycbcr_row
+YCbCr convert_rgb_to_ycbcr(RGB rgb)
+{
+    YCbCr ycbcr;
+
+    // Using BT.601 conversion
+    ycbcr.y = (uint8_t)(0.299 * rgb.r + 0.587 * rgb.g + 0.114 * rgb.b);
+    ycbcr.cb = (uint8_t)(-0.169 * rgb.r - 0.331 * rgb.g + 0.500 * rgb.b + 128);
+    ycbcr.cr = (uint8_t)(0.500 * rgb.r - 0.419 * rgb.g - 0.081 * rgb.b + 128);
+
+    return ycbcr;
+}
+
+// Row-oriented JFIF RGB -> YCbCr conversion with 14-bit fixed-point
+// coefficients. Each row of coefficients sums to exactly 1.0 (Y) or 0.0
+// (Cb, Cr), results are rounded to nearest and clamped to 0..255, and the
+// SIMD kernels below compute bit-identical results to the scalar one.
+#define YCC_SCALEBITS 14
+#define YCC_ONE_HALF (1 << (YCC_SCALEBITS - 1))
+#define YCC_CENTER (128 << YCC_SCALEBITS)
+
+#define YCC_Y_R 4899   // 0.29900
+#define YCC_Y_G 9617   // 0.58700
+#define YCC_Y_B 1868   // 0.11400
+#define YCC_CB_R -2765 // -0.16874
+#define YCC_CB_G -5427 // -0.33126
+#define YCC_CB_B 8192  // 0.50000
+#define YCC_CR_R 8192  // 0.50000
+#define YCC_CR_G -6860 // -0.41869
+#define YCC_CR_B -1332 // -0.08131
+
+static void rgb_to_ycbcr_row_scalar(const uint8_t *rgb, uint8_t *y, uint8_t *cb,
+                                    uint8_t *cr, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++, rgb += 3)
+    {
+        const int r = rgb[0], g = rgb[1], b = rgb[2];
+        const int yy = (YCC_Y_R * r + YCC_Y_G * g + YCC_Y_B * b + YCC_ONE_HALF) >> YCC_SCALEBITS;
+        const int cbb = (YCC_CB_R * r + YCC_CB_G * g + YCC_CB_B * b + YCC_CENTER + YCC_ONE_HALF) >> YCC_SCALEBITS;
+        const int crr = (YCC_CR_R * r + YCC_CR_G * g + YCC_CR_B * b + YCC_CENTER + YCC_ONE_HALF) >> YCC_SCALEBITS;
+        y[x] = (uint8_t)CLAMP(yy, 0, 255);
+        cb[x] = (uint8_t)CLAMP(cbb, 0, 255);
+        cr[x] = (uint8_t)CLAMP(crr, 0, 255);
+    }
+}
+
+#ifdef JPEG_X86_SIMD
+// pshufb masks gathering the R, G and B bytes of 16 packed RGB24 pixels
+// from the three 16-byte loads that hold them (0x80 selects zero)
+static const uint8_t RGB24_SHUFFLE[9][16] = {
+    {0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13},
+    {1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14},
+    {2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+    {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15}};
+
+// Split three loads of packed pixels into planar R, G, B bytes
+#define YCC_DEINTERLEAVE(V, VT, mask, v0, v1, v2, r, g, b)                       \
+    do                                                                           \
+    {                                                                            \
+        r = V(or_si##VT)(V(or_si##VT)(V(shuffle_epi8)(v0, mask[0]),              \
+                                      V(shuffle_epi8)(v1, mask[1])),             \
+                         V(shuffle_epi8)(v2, mask[2]));                          \
+        g = V(or_si##VT)(V(or_si##VT)(V(shuffle_epi8)(v0, mask[3]),              \
+                                      V(shuffle_epi8)(v1, mask[4])),             \
+                         V(shuffle_epi8)(v2, mask[5]));                          \
+        b = V(or_si##VT)(V(or_si##VT)(V(shuffle_epi8)(v0, mask[6]),              \
+                                      V(shuffle_epi8)(v1, mask[7])),             \
+                         V(shuffle_epi8)(v2, mask[8]));                          \
+    } while (0)
+
+// One output channel from interleaved (r, g) and (b, 0) 16-bit pairs; the
+// final saturating packs provide the clamp to 0..255
+#define YCC_CHANNEL(V, out, rg, bz, coef_r, coef_g, coef_b, bias)                \
+    do                                                                           \
+    {                                                                            \
+        const __typeof__(rg[0]) k_rg_ = V(set1_epi32)(                           \
+            (int32_t)(((uint32_t)(uint16_t)(coef_g) << 16) | (uint16_t)(coef_r))); \
+        const __typeof__(rg[0]) k_b_ = V(set1_epi32)((uint16_t)(coef_b));        \
+        const __typeof__(rg[0]) bias_ = V(set1_epi32)(bias);                     \
+        __typeof__(rg[0]) q_[4];                                                 \
+        for (int i_ = 0; i_ < 4; i_++)                                           \
+        {                                                                        \
+            q_[i_] = V(add_epi32)(V(add_epi32)(V(madd_epi16)(rg[i_], k_rg_),     \
+                                               V(madd_epi16)(bz[i_], k_b_)),     \
+                                  bias_);                                        \
+            q_[i_] = V(srai_epi32)(q_[i_], YCC_SCALEBITS);                       \
+        }                                                                        \
+        out = V(packus_epi16)(V(packs_epi32)(q_[0], q_[1]),                      \
+                              V(packs_epi32)(q_[2], q_[3]));                     \
+    } while (0)
+
+// Widen 8-bit planar R, G, B into the pair layout YCC_CHANNEL expects
+#define YCC_PAIRS(V, r, g, b, zero, rg, bz)                                      \
+    do                                                                           \
+    {                                                                            \
+        const __typeof__(r) r_lo_ = V(unpacklo_epi8)(r, zero);                   \
+        const __typeof__(r) r_hi_ = V(unpackhi_epi8)(r, zero);                   \
+        const __typeof__(r) g_lo_ = V(unpacklo_epi8)(g, zero);                   \
+        const __typeof__(r) g_hi_ = V(unpackhi_epi8)(g, zero);                   \
+        const __typeof__(r) b_lo_ = V(unpacklo_epi8)(b, zero);                   \
+        const __typeof__(r) b_hi_ = V(unpackhi_epi8)(b, zero);                   \
+        rg[0] = V(unpacklo_epi16)(r_lo_, g_lo_);                                 \
+        rg[1] = V(unpackhi_epi16)(r_lo_, g_lo_);                                 \
+        rg[2] = V(unpacklo_epi16)(r_hi_, g_hi_);                                 \
+        rg[3] = V(unpackhi_epi16)(r_hi_, g_hi_);                                 \
+        bz[0] = V(unpacklo_epi16)(b_lo_, zero);                                  \
+        bz[1] = V(unpackhi_epi16)(b_lo_, zero);                                  \
+        bz[2] = V(unpacklo_epi16)(b_hi_, zero);                                  \
+        bz[3] = V(unpackhi_epi16)(b_hi_, zero);                                  \
+    } while (0)
+
+#define YCC_SSE(op) _mm_##op
+
+// 16 pixels per iteration
+TARGET_SSSE3 static void rgb_to_ycbcr_row_ssse3(const uint8_t *rgb, uint8_t *y, uint8_t *cb,
+                                                uint8_t *cr, uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i mask[9];
+    for (int i = 0; i < 9; i++)
+    {
+        mask[i] = _mm_loadu_si128((const __m128i *)RGB24_SHUFFLE[i]);
+    }
+
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16, rgb += 48)
+    {
+        const __m128i v0 = _mm_loadu_si128((const __m128i *)rgb);
+        const __m128i v1 = _mm_loadu_si128((const __m128i *)(rgb + 16));
+        const __m128i v2 = _mm_loadu_si128((const __m128i *)(rgb + 32));
+        __m128i r, g, b, rg[4], bz[4], out;
+
+        YCC_DEINTERLEAVE(YCC_SSE, 128, mask, v0, v1, v2, r, g, b);
+        YCC_PAIRS(YCC_SSE, r, g, b, zero, rg, bz);
+
+        YCC_CHANNEL(YCC_SSE, out, rg, bz, YCC_Y_R, YCC_Y_G, YCC_Y_B, YCC_ONE_HALF);
+        _mm_storeu_si128((__m128i *)(y + x), out);
+        YCC_CHANNEL(YCC_SSE, out, rg, bz, YCC_CB_R, YCC_CB_G, YCC_CB_B, YCC_CENTER + YCC_ONE_HALF);
+        _mm_storeu_si128((__m128i *)(cb + x), out);
+        YCC_CHANNEL(YCC_SSE, out, rg, bz, YCC_CR_R, YCC_CR_G, YCC_CR_B, YCC_CENTER + YCC_ONE_HALF);
+        _mm_storeu_si128((__m128i *)(cr + x), out);
+    }
+
+    rgb_to_ycbcr_row_scalar(rgb, y + x, cb + x, cr + x, width - x);
+}
+
+#define YCC_AVX2(op) _mm256_##op
+
+// 32 pixels per iteration, 16 in each 128-bit lane so pshufb stays in-lane
+TARGET_AVX2 static void rgb_to_ycbcr_row_avx2(const uint8_t *rgb, uint8_t *y, uint8_t *cb,
+                                              uint8_t *cr, uint32_t width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i mask[9];
+    for (int i = 0; i < 9; i++)
+    {
+        mask[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)RGB24_SHUFFLE[i]));
+    }
+
+    uint32_t x = 0;
+    for (; x + 32 <= width; x += 32, rgb += 96)
+    {
+        const __m256i v0 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)rgb)),
+            _mm_loadu_si128((const __m128i *)(rgb + 48)), 1);
+        const __m256i v1 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(rgb + 16))),
+            _mm_loadu_si128((const __m128i *)(rgb + 64)), 1);
+        const __m256i v2 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(rgb + 32))),
+            _mm_loadu_si128((const __m128i *)(rgb + 80)), 1);
+        __m256i r, g, b, rg[4], bz[4], out;
+
+        YCC_DEINTERLEAVE(YCC_AVX2, 256, mask, v0, v1, v2, r, g, b);
+        YCC_PAIRS(YCC_AVX2, r, g, b, zero, rg, bz);
+
+        YCC_CHANNEL(YCC_AVX2, out, rg, bz, YCC_Y_R, YCC_Y_G, YCC_Y_B, YCC_ONE_HALF);
+        _mm256_storeu_si256((__m256i *)(y + x), out);
+        YCC_CHANNEL(YCC_AVX2, out, rg, bz, YCC_CB_R, YCC_CB_G, YCC_CB_B, YCC_CENTER + YCC_ONE_HALF);
+        _mm256_storeu_si256((__m256i *)(cb + x), out);
+        YCC_CHANNEL(YCC_AVX2, out, rg, bz, YCC_CR_R, YCC_CR_G, YCC_CR_B, YCC_CENTER + YCC_ONE_HALF);
+        _mm256_storeu_si256((__m256i *)(cr + x), out);
+    }
+
+    rgb_to_ycbcr_row_ssse3(rgb, y + x, cb + x, cr + x, width - x);
+}
+#endif
+
+// 2x2 chroma downsampling of two full-resolution rows. The rounding bias
+// alternates between 1 and 2 (as libjpeg does) so averages do not drift
+// upwards; output positions start even, so SIMD blocks keep the pattern.
+static void downsample_h2v2_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+                                   uint32_t out_width)
+{
+    for (uint32_t i = 0; i < out_width; i++)
+    {
+        const int bias = (i & 1) ? 2 : 1;
+        out[i] = (uint8_t)((row0[2 * i] + row0[2 * i + 1] + row1[2 * i] + row1[2 * i + 1] + bias) >> 2);
+    }
+}
+
+#ifdef JPEG_X86_SIMD
+// 16 outputs per iteration; pmaddubsw with ones sums horizontal pairs
+TARGET_SSSE3 static void downsample_h2v2_ssse3(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+                                               uint32_t out_width)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i bias = _mm_set1_epi32(0x00020001);
+    uint32_t i = 0;
+
+    for (; i + 16 <= out_width; i += 16)
+    {
+        __m128i sum[2];
+        for (int h = 0; h < 2; h++)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(row0 + 2 * i + 16 * h));
+            const __m128i b = _mm_loadu_si128((const __m128i *)(row1 + 2 * i + 16 * h));
+            sum[h] = _mm_add_epi16(_mm_maddubs_epi16(a, ones), _mm_maddubs_epi16(b, ones));
+            sum[h] = _mm_srli_epi16(_mm_add_epi16(sum[h], bias), 2);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sum[0], sum[1]));
+    }
+
+    downsample_h2v2_scalar(row0 + 2 * i, row1 + 2 * i, out + i, out_width - i);
+}
+
+// 32 outputs per iteration; packus works per lane, so fix the order after
+TARGET_AVX2 static void downsample_h2v2_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *out,
+                                             uint32_t out_width)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i bias = _mm256_set1_epi32(0x00020001);
+    uint32_t i = 0;
+
+    for (; i + 32 <= out_width; i += 32)
+    {
+        __m256i sum[2];
+        for (int h = 0; h < 2; h++)
+        {
+            const __m256i a = _mm256_loadu_si256((const __m256i *)(row0 + 2 * i + 32 * h));
+            const __m256i b = _mm256_loadu_si256((const __m256i *)(row1 + 2 * i + 32 * h));
+            sum[h] = _mm256_add_epi16(_mm256_maddubs_epi16(a, ones), _mm256_maddubs_epi16(b, ones));
+            sum[h] = _mm256_srli_epi16(_mm256_add_epi16(sum[h], bias), 2);
+        }
+        const __m256i packed = _mm256_packus_epi16(sum[0], sum[1]);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+
+    downsample_h2v2_ssse3(row0 + 2 * i, row1 + 2 * i, out + i, out_width - i);
+}
+#endif
+
+// 4:2:2 averages horizontal pairs with bias alternating 0, 1 (libjpeg's
+// h2v1_downsample)
+static void downsample_h2v1_scalar(const uint8_t *row, uint8_t *out, uint32_t out_width)
+{
+    for (uint32_t i = 0; i < out_width; i++)
+    {
+        out[i] = (uint8_t)((row[2 * i] + row[2 * i + 1] + (int)(i & 1)) >> 1);
+    }
+}
+
+#ifdef JPEG_X86_SIMD
+TARGET_SSSE3 static void downsample_h2v1_ssse3(const uint8_t *row, uint8_t *out, uint32_t out_width)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i bias = _mm_set1_epi32(0x00010000);
+    uint32_t i = 0;
+
+    for (; i + 16 <= out_width; i += 16)
+    {
+        __m128i sum[2];
+        for (int h = 0; h < 2; h++)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(row + 2 * i + 16 * h));
+            sum[h] = _mm_srli_epi16(_mm_add_epi16(_mm_maddubs_epi16(a, ones), bias), 1);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(sum[0], sum[1]));
+    }
+
+    downsample_h2v1_scalar(row + 2 * i, out + i, out_width - i);
+}
+
+TARGET_AVX2 static void downsample_h2v1_avx2(const uint8_t *row, uint8_t *out, uint32_t out_width)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i bias = _mm256_set1_epi32(0x00010000);
+    uint32_t i = 0;
+
+    for (; i + 32 <= out_width; i += 32)
+    {
+        __m256i sum[2];
+        for (int h = 0; h < 2; h++)
+        {
+            const __m256i a = _mm256_loadu_si256((const __m256i *)(row + 2 * i + 32 * h));
+            sum[h] = _mm256_srli_epi16(_mm256_add_epi16(_mm256_maddubs_epi16(a, ones), bias), 1);
+        }
+        const __m256i packed = _mm256_packus_epi16(sum[0], sum[1]);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+
+    downsample_h2v1_ssse3(row + 2 * i, out + i, out_width - i);
+}
+#endif
+
+// Kernel sets from the most portable up; each needs the CPU features of
+// the sets before it. A set reuses the kernels below it where its own
+// instructions have nothing to add. There are no AVX-512 kernels yet, so
+// that tier runs the AVX2 ones; it exists so that dispatch, JPEG_SIMD and
+// the benchmark already know AVX-512 hosts.
+static const JpegKernels KERNELS[] = {
+    {"scalar", fdct_islow_scalar, rgb_to_ycbcr_row_scalar, downsample_h2v2_scalar, downsample_h2v1_scalar,
+     quantize_zigzag_scalar},
+#ifdef JPEG_X86_SIMD
+    {"sse2", fdct_islow_sse2, rgb_to_ycbcr_row_scalar, downsample_h2v2_scalar, downsample_h2v1_scalar,
+     quantize_zigzag_scalar},
+    {"ssse3", fdct_islow_sse2, rgb_to_ycbcr_row_ssse3, downsample_h2v2_ssse3, downsample_h2v1_ssse3,
+     quantize_zigzag_ssse3},
+    {"avx2", fdct_islow_avx2, rgb_to_ycbcr_row_avx2, downsample_h2v2_avx2, downsample_h2v1_avx2,
+     quantize_zigzag_avx2},
+    {"avx512", fdct_islow_avx2, rgb_to_ycbcr_row_avx2, downsample_h2v2_avx2, downsample_h2v1_avx2,
+     quantize_zigzag_avx2},
+#endif
+};
+
+// Number of leading KERNELS entries this CPU can run
+static int supported_kernel_count(void)
+{
+#ifdef JPEG_X86_SIMD
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return 5;
+    if (__builtin_cpu_supports("avx2"))
+        return 4;
+    if (__builtin_cpu_supports("ssse3"))
+        return 3;
+    if (__builtin_cpu_supports("sse2"))
+        return 2;
+#endif
+    return 1;
+}
+
+// The widest kernel set the CPU supports. The JPEG_SIMD environment
+// variable (scalar, sse2, ssse3, avx2 or avx512) forces a narrower set for
+// testing. A name that is unknown or that the CPU lacks is reported on
+// stderr, once, and the widest set is used instead. The choice is made on
+// first use and kept for the process.
+static const JpegKernels *selected_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernels(void)
+{
+    const int count = supported_kernel_count();
+    const char *forced = getenv("JPEG_SIMD");
+    selected_kernels = &KERNELS[count - 1];
+    if (!forced)
+        return;
+
+    for (size_t i = 0; i < sizeof(KERNELS) / sizeof(KERNELS[0]); i++)
+    {
+        if (strcmp(forced, KERNELS[i].name) != 0)
+            continue;
+        if ((int)i < count)
+        {
+            selected_kernels = &KERNELS[i];
+            return;
+        }
+        fprintf(stderr, "Warning: JPEG_SIMD=%s is not supported by this CPU, using %s\n", forced,
+                selected_kernels->name);
+        return;
+    }
+    fprintf(stderr, "Warning: JPEG_SIMD=%s is not a kernel set, using %s\n", forced, selected_kernels->name);
+}
+
+static const JpegKernels *select_kernels(void)
+{
+    pthread_once(&kernels_once, choose_kernels);
+    return selected_kernels;
+}
+
+// Command line helpers, left out with main (see JPEG_NO_MAIN)
+#ifndef JPEG_NO_MAIN
+
+// IEEE 1180-style accuracy check of a DCT method against apply_dct.
+// Random blocks are drawn from the standard's generator over several sample
+// ranges and their mirror images. The tested coefficients are taken at the
+// precision the quantizer sees (1/8 unit) and compared with the exact
+// reference; per-coefficient peak, mean square and mean errors must stay
+// within the limits of the standard. The integer method is also checked
+// against its scalar kernel so SIMD builds stay bit-exact. The double
+// precision AAN transform is held to double precision: before rounding it
+// must match the reference to DCT_FAST_EXACT_LIMIT, and after rounding
+// it may only be off by the half step of 1/16 that rounding allows.
+#define DCT_CHECK_BLOCKS 10000
+#define DCT_FAST_EXACT_LIMIT 1e-9
+
+static int ieee1180_random(uint32_t *seed, int low, int high)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    const double x = (*seed & 0x7ffffffe) / (double)0x7fffffff;
+    return (int)(x * (low + high + 1)) - low;
+}
+
+static int check_dct_accuracy(DctMethod method)
+{
+    static const int ranges[][2] = {{128, 127}, {64, 63}, {5, 5}};
+    JpegState probe = {0};
+    probe.dct_method = method;
+    probe.kernels = select_kernels();
+    const int kernel_count = supported_kernel_count();
+    int simd_mismatches = 0;
+    double exact_peak = 0.0; // Unrounded error of DCT_FAST
+    int failed = 0;
+
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+    {
+        for (int mirror = 0; mirror < 2; mirror++)
+        {
+            uint32_t seed = 1;
+            double sum_err[64] = {0};
+            double sum_sq[64] = {0};
+            double peak = 0.0;
+
+            for (int n = 0; n < DCT_CHECK_BLOCKS; n++)
+            {
+                uint8_t block[BLOCK_SIZE][BLOCK_SIZE];
+                for (int i = 0; i < 64; i++)
+                {
+                    const int v = 128 + ieee1180_random(&seed, ranges[r][0], ranges[r][1]);
+                    block[i / BLOCK_SIZE][i % BLOCK_SIZE] = (uint8_t)(mirror ? 255 - v : v);
+                }
+
+                const DctBlock ref = apply_dct(block);
+                int16_t coefs[64];
+                forward_dct_blocks(&probe, &block[0][0], coefs, 1);
+                if (method == DCT_FAST)
+                {
+                    const DctBlock fast = apply_dct_fast(block);
+                    for (int i = 0; i < 64; i++)
+                    {
+                        const double err = fabs(fast.data[i / BLOCK_SIZE][i % BLOCK_SIZE] -
+                                                ref.data[i / BLOCK_SIZE][i % BLOCK_SIZE]);
+                        exact_peak = err > exact_peak ? err : exact_peak;
+                    }
+                }
+
+                // Every SIMD kernel the CPU runs must agree bit for bit with
+                // the scalar one
+                for (int k = 1; method == DCT_INT && k < kernel_count; k++)
+                {
+                    int16_t scalar[64], simd[64];
+                    fdct_islow_scalar(&block[0][0], scalar, 1);
+                    KERNELS[k].fdct_islow(&block[0][0], simd, 1);
+                    simd_mismatches += memcmp(scalar, simd, sizeof(scalar)) != 0;
+                }
+
+                for (int i = 0; i < 64; i++)
+                {
+                    const double err = coefs[i] / 8.0 - ref.data[i / BLOCK_SIZE][i % BLOCK_SIZE];
+                    sum_err[i] += err;
+                    sum_sq[i] += err * err;
+                    if (fabs(err) > peak)
+                        peak = fabs(err);
+                }
+            }
+
+            double worst_mse = 0.0, worst_mean = 0.0, total_sq = 0.0, total_err = 0.0;
+            for (int i = 0; i < 64; i++)
+            {
+                const double mse = sum_sq[i] / DCT_CHECK_BLOCKS;
+                const double mean = fabs(sum_err[i] / DCT_CHECK_BLOCKS);
+                worst_mse = mse > worst_mse ? mse : worst_mse;
+                worst_mean = mean > worst_mean ? mean : worst_mean;
+                total_sq += sum_sq[i];
+                total_err += sum_err[i];
+            }
+            const double overall_mse = total_sq / (64.0 * DCT_CHECK_BLOCKS);
+            const double overall_mean = fabs(total_err) / (64.0 * DCT_CHECK_BLOCKS);
+
+            const double peak_limit = method == DCT_FAST ? 1.0 / 16 + DCT_FAST_EXACT_LIMIT : 1.0;
+            const int pass = peak <= peak_limit && worst_mse <= 0.06 && overall_mse <= 0.02 &&
+                             worst_mean <= 0.015 && overall_mean <= 0.0015;
+            printf("  range -%d..+%d%s: peak %.3f, mse %.4f (overall %.4f), mean %.4f (overall %.5f) %s\n",
+                   ranges[r][0], ranges[r][1], mirror ? " mirrored" : "", peak,
+                   worst_mse, overall_mse, worst_mean, overall_mean, pass ? "ok" : "FAIL");
+            failed |= !pass;
+        }
+    }
+
+    if (method == DCT_FAST)
+    {
+        const int pass = exact_peak <= DCT_FAST_EXACT_LIMIT;
+        printf("  before rounding: peak %.1e %s\n", exact_peak, pass ? "ok" : "FAIL");
+        failed |= !pass;
+    }
+    if (simd_mismatches > 0)
+    {
+        printf("  %d blocks differ between the SIMD and scalar kernels FAIL\n", simd_mismatches);
+        failed = 1;
+    }
+
+    return failed ? -1 : 0;
+}
+
+// Parse a --dct option value; returns -1 for unknown names
+static int parse_dct_method(const char *name, DctMethod *method)
+{
+    if (strcmp(name, "ref") == 0)
+        *method = DCT_REFERENCE;
+    else if (strcmp(name, "fast") == 0)
+        *method = DCT_FAST;
+    else if (strcmp(name, "float") == 0)
+        *method = DCT_FAST_FLOAT;
+    else if (strcmp(name, "int") == 0)
+        *method = DCT_INT;
+    else
+        return -1;
+    return 0;
+}
+#endif // JPEG_NO_MAIN
+
+// Width of the strip planes: the image width rounded up to whole MCUs
+static uint32_t padded_width(const JpegState *state)
+{
+    return mcu_cols_of(state) * mcu_width_of(state);
+}
+
+// Downsample the v full-resolution Cb/Cr rows waiting in chroma_rows into
+// row cy of the chroma planes
+static void apply_chroma_subsampling(const JpegState *state, StripBuffers *strip, uint32_t cy)
+{
+    const uint32_t v = mcu_v_factor(state);
+    const uint32_t out_width = padded_width(state) / mcu_h_factor(state);
+
+    for (int c = 0; c < 2; c++)
+    {
+        const uint8_t *rows = strip->chroma_rows + (size_t)c * v * strip->stride_y;
+        uint8_t *out = (c == 0 ? strip->plane_cb : strip->plane_cr) + (size_t)cy * strip->stride_c;
+        if (state->chroma_layout == CHROMA_420)
+            state->kernels->downsample_h2v2(rows, rows + strip->stride_y, out, out_width);
+        else if (state->chroma_layout == CHROMA_422)
+            state->kernels->downsample_h2v1(rows, out, out_width);
+        else
+            memcpy(out, rows, out_width); // 4:4:4 keeps chroma at full resolution
+    }
+}
+
+// Repeat the last pixel of a row out to the padded width
+static inline void pad_row(uint8_t *row, uint32_t width, uint32_t padded)
+{
+    memset(row + width, row[width - 1], padded - width);
+}
+
+// Convert row r of an MCU-tall strip from interleaved RGB into strip's
+// planes. Rows must arrive in order; every v rows the waiting
+// full-resolution chroma rows are downsampled, so only v of them ever
+// exist.
+static void convert_row(const JpegState *state, StripBuffers *strip, const uint8_t *rgb, uint32_t r)
+{
+    const uint32_t v = mcu_v_factor(state);
+    const uint32_t padded = padded_width(state);
+    const uint32_t k = r % v;
+
+    uint8_t *row_y = strip->plane_y + (size_t)r * strip->stride_y;
+    uint8_t *row_cb = strip->chroma_rows + (size_t)k * strip->stride_y;
+    uint8_t *row_cr = strip->chroma_rows + (size_t)(v + k) * strip->stride_y;
+
+    // Grayscale keeps Y only; chroma lands in scratch rows and is dropped
+    state->kernels->rgb_to_ycbcr_row(rgb, row_y, row_cb, row_cr, state->width);
+    pad_row(row_y, state->width, padded);
+    if (state->num_components == 1)
+        return;
+    pad_row(row_cb, state->width, padded);
+    pad_row(row_cr, state->width, padded);
+
+    if (k == v - 1)
+        apply_chroma_subsampling(state, strip, r / v);
+}
+
+// Convert the MCU-tall strip starting at image row y0 of rgb_data into
+// strip's planes. Rows below the image repeat the last image row.
+static void convert_strip(const JpegState *state, StripBuffers *strip, uint32_t y0)
+{
+    const uint32_t mcu_height = mcu_height_of(state);
+
+    for (uint32_t r = 0; r < mcu_height; r++)
+    {
+        uint32_t src_y = y0 + r;
+        if (src_y >= state->height)
+            src_y = state->height - 1;
+
+        convert_row(state, strip, (const uint8_t *)&state->rgb_data[(size_t)src_y * state->width], r);
+    }
+}
+
+// Complete a strip whose image rows end before row from by repeating the
+// last converted row, as convert_strip does, without needing its pixels
+static void replicate_strip_rows(const JpegState *state, StripBuffers *strip, uint32_t from)
+{
+    const uint32_t v = mcu_v_factor(state);
+    const uint32_t mcu_height = mcu_height_of(state);
+    const uint32_t last = from - 1;
+    const uint32_t last_k = last % v;
+
+    for (uint32_t r = from; r < mcu_height; r++)
+    {
+        const uint32_t k = r % v;
+        memcpy(strip->plane_y + (size_t)r * strip->stride_y, strip->plane_y + (size_t)last * strip->stride_y,
+               strip->stride_y);
+        if (state->num_components == 1)
+            continue;
+        if (k != last_k)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                uint8_t *rows = strip->chroma_rows + (size_t)c * v * strip->stride_y;
+                memcpy(rows + (size_t)k * strip->stride_y, rows + (size_t)last_k * strip->stride_y,
+                       strip->stride_y);
+            }
+        }
+
+        if (k == v - 1)
+            apply_chroma_subsampling(state, strip, r / v);
+    }
+}
+
+// Largest MCU of any layout; strips are sized for it so that switching
+// layouts or grayscale never needs a new strip
+#define MAX_MCU_SIZE (2 * BLOCK_SIZE)
+
+// Row stride that strip planes need for an image of the given width
+static uint32_t strip_stride(uint32_t width)
+{
+    return align_up((width + MAX_MCU_SIZE - 1) / MAX_MCU_SIZE * MAX_MCU_SIZE, 64);
+}
+
+// Strides and buffer sizes of a strip for state's width: Y one MCU tall,
+// Cb/Cr eight rows (4:4:4 needs them at full width), plus two rows per
+// chroma component awaiting downsampling
+static void strip_layout(const JpegState *state, StripBuffers *strip, size_t sizes[4])
+{
+    strip->stride_y = strip_stride(state->width);
+    strip->stride_c = strip->stride_y;
+    sizes[0] = (size_t)strip->stride_y * MAX_MCU_SIZE;
+    sizes[1] = (size_t)strip->stride_c * BLOCK_SIZE;
+    sizes[2] = (size_t)strip->stride_c * BLOCK_SIZE;
+    sizes[3] = (size_t)strip->stride_y * 2 * (MAX_MCU_SIZE / BLOCK_SIZE);
+}
+
+// Allocate strip planes from arena, or from the heap if arena is NULL
+static int alloc_strip_buffers(const JpegState *state, StripBuffers *strip, Arena *arena)
+{
+    size_t sizes[4];
+    strip_layout(state, strip, sizes);
+    strip->plane_y = buffer_alloc(arena, sizes[0]);
+    strip->plane_cb = buffer_alloc(arena, sizes[1]);
+    strip->plane_cr = buffer_alloc(arena, sizes[2]);
+    strip->chroma_rows = buffer_alloc(arena, sizes[3]);
+    strip->mcu_row = UINT32_MAX;
+
+    if (!strip->plane_y || !strip->plane_cb || !strip->plane_cr || !strip->chroma_rows)
+        return -1;
+    return 0;
+}
+
+static void free_strip_buffers(StripBuffers *strip)
+{
+    free(strip->plane_y);
+    free(strip->plane_cb);
+    free(strip->plane_cr);
+    free(strip->chroma_rows);
+    strip->plane_y = strip->plane_cb = strip->plane_cr = strip->chroma_rows = NULL;
+}
+
+// Encode MCUs [first, first + count) in raster order as one entropy-coded
+// segment. DC predictors start from zero and the last byte is padded, so
+// a segment does not depend on any other. Strips are converted as the
+// segment reaches them and the writer is flushed after each MCU row.
+static void encode_segment(const JpegState *state, StripBuffers *strip, JpegWriter *writer,
+                           uint32_t first, uint32_t count)
+{
+    const uint32_t mcu_width = mcu_width_of(state);
+    const uint32_t mcu_height = mcu_height_of(state);
+    const uint32_t mcus_per_row = mcu_cols_of(state);
+    uint32_t row = first / mcus_per_row;
+    uint32_t col = first % mcus_per_row;
+
+    memset(writer->last_dc, 0, sizeof(writer->last_dc));
+    for (uint32_t i = 0; i < count && !writer->sink_error; i++)
+    {
+        if (strip->mcu_row != row)
+        {
+            convert_strip(state, strip, row * mcu_height);
+            strip->mcu_row = row;
+        }
+
+        process_mcu(state, strip, writer, col * mcu_width);
+
+        if (++col == mcus_per_row)
+        {
+            col = 0;
+            row++;
+            flush_output(writer);
+        }
+    }
+
+    flush_bits(writer);
+}
+
+// Parallel restart segments: workers claim segments of a batch, encode each
+// into its own memory buffer, and the batch is then written out in order
+// with RSTn markers in between. Batches bound the memory held at once.
+#define SEGMENTS_PER_THREAD 4
+
+typedef struct
+{
+    const JpegState *state;
+    uint32_t first_segment;   // Index of the batch's first segment
+    uint32_t segment_count;   // Segments in this batch
+    uint32_t total_mcus;
+    JpegMemoryBuffer *output; // Encoded bytes of each segment of the batch
+    uint32_t next;            // Next segment to claim, updated atomically
+} SegmentBatch;
+
+typedef struct
+{
+    SegmentBatch *batch;
+    StripBuffers strip;
+    uint8_t buffer[OUTPUT_BUFFER_SIZE];
+    pthread_t thread;
+    int error;
+} SegmentWorker;
+
+static void *segment_worker_main(void *arg)
+{
+    SegmentWorker *worker = arg;
+    SegmentBatch *batch = worker->batch;
+    const uint32_t interval = batch->state->restart_interval;
+
+    for (;;)
+    {
+        const uint32_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->segment_count)
+            break;
+
+        const uint32_t first = (batch->first_segment + i) * interval;
+        const uint32_t count = batch->total_mcus - first < interval ? batch->total_mcus - first : interval;
+
+        JpegWriter writer;
+        batch->output[i].size = 0;
+        init_writer(&writer, jpeg_memory_sink(&batch->output[i]), worker->buffer, sizeof(worker->buffer));
+        encode_segment(batch->state, &worker->strip, &writer, first, count);
+        flush_output(&writer);
+        if (writer.sink_error)
+            worker->error = 1;
+    }
+
+    return NULL;
+}
+
+static int encode_segments_parallel(JpegState *state, uint32_t total_mcus)
+{
+    const uint32_t interval = state->restart_interval;
+    const uint32_t num_segments = (total_mcus + interval - 1) / interval;
+    const int num_workers = state->num_threads;
+    const uint32_t batch_size = (uint32_t)num_workers * SEGMENTS_PER_THREAD;
+
+    SegmentWorker *workers = calloc(num_workers, sizeof(SegmentWorker));
+    JpegMemoryBuffer *output = calloc(batch_size, sizeof(JpegMemoryBuffer));
+    int status = (workers && output) ? 0 : -1;
+    for (int t = 0; t < num_workers && status == 0; t++)
+    {
+        if (alloc_strip_buffers(state, &workers[t].strip, NULL) != 0)
+            status = -1;
+    }
+
+    for (uint32_t s = 0; s < num_segments && status == 0; s += batch_size)
+    {
+        SegmentBatch batch = {state, s, num_segments - s < batch_size ? num_segments - s : batch_size,
+                              total_mcus, output, 0};
+
+        // Worker 0 runs on this thread; if a thread fails to start, the
+        // others simply claim its share of the batch
+        int started = 1;
+        for (int t = 1; t < num_workers; t++)
+        {
+            workers[t].batch = &batch;
+            if (pthread_create(&workers[t].thread, NULL, segment_worker_main, &workers[t]) != 0)
+                break;
+            started++;
+        }
+        workers[0].batch = &batch;
+        segment_worker_main(&workers[0]);
+        for (int t = 1; t < started; t++)
+        {
+            pthread_join(workers[t].thread, NULL);
+        }
+
+        for (int t = 0; t < num_workers; t++)
+        {
+            if (workers[t].error)
+                status = -1;
+        }
+
+        for (uint32_t i = 0; i < batch.segment_count && status == 0; i++)
+        {
+            if (s + i > 0)
+                write_marker(state, MARKER_RST0 + ((s + i - 1) & 7));
+            write_bytes(state, output[i].data, output[i].size);
+        }
+        flush_output(&state->writer);
+    }
+
+    if (workers)
+    {
+        for (int t = 0; t < num_workers; t++)
+        {
+            free_strip_buffers(&workers[t].strip);
+        }
+    }
+    if (output)
+    {
+        for (uint32_t i = 0; i < batch_size; i++)
+        {
+            free(output[i].data);
+        }
+    }
+    free(workers);
+    free(output);
+    return status;
+}
+
+// MCU-row pipeline for encodes without restart intervals: worker threads
+// convert, downsample, transform and quantize whole MCU rows into a ring
+// of coefficient rows, and the calling thread entropy codes the rows in
+// order as they complete. The ring bounds how far workers run ahead.
+#define PIPELINE_ROWS_PER_THREAD 2
+
+typedef struct
+{
+    const JpegState *state;
+    uint32_t mcus_per_row;
+    uint32_t mcu_rows;
+    uint32_t depth;       // Rows in the ring
+    size_t row_blocks;    // Blocks in one MCU row
+    int16_t *coefs;       // depth rows of quantized zigzag blocks
+    uint32_t *slot_row;   // Row whose coefficients each slot holds
+    uint32_t next_row;    // Next row for a worker to claim
+    uint32_t next_encode; // Next row for the entropy stage
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t row_ready;
+    pthread_cond_t slot_free;
+} RowPipeline;
+
+typedef struct
+{
+    RowPipeline *pipeline;
+    StripBuffers strip;
+    pthread_t thread;
+} RowWorker;
+
+static inline int16_t (*pipeline_slot(const RowPipeline *pipeline, uint32_t row))[BLOCK_SIZE * BLOCK_SIZE]
+{
+    return (int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])(pipeline->coefs + (row % pipeline->depth) *
+                                                                      pipeline->row_blocks * BLOCK_SIZE * BLOCK_SIZE);
+}
+
+static void *row_worker_main(void *arg)
+{
+    RowWorker *worker = arg;
+    RowPipeline *pipeline = worker->pipeline;
+    const JpegState *state = pipeline->state;
+    const uint32_t mcu_width = mcu_width_of(state);
+    const uint32_t mcu_height = mcu_height_of(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+
+    for (;;)
+    {
+        // Claim a row, then wait until the entropy stage has released the
+        // slot it maps to
+        pthread_mutex_lock(&pipeline->lock);
+        const uint32_t row = pipeline->next_row;
+        if (row < pipeline->mcu_rows)
+            pipeline->next_row++;
+        while (!pipeline->abort && row < pipeline->mcu_rows &&
+               row >= pipeline->next_encode + pipeline->depth)
+        {
+            pthread_cond_wait(&pipeline->slot_free, &pipeline->lock);
+        }
+        const int done = pipeline->abort || row >= pipeline->mcu_rows;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (done)
+            break;
+
+        int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = pipeline_slot(pipeline, row);
+        convert_strip(state, &worker->strip, row * mcu_height);
+        worker->strip.mcu_row = row;
+        for (uint32_t col = 0; col < pipeline->mcus_per_row; col++)
+        {
+            analyze_mcu(state, &worker->strip, col * mcu_width, blocks + col * blocks_per_mcu);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->slot_row[row % pipeline->depth] = row;
+        pthread_cond_broadcast(&pipeline->row_ready);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    return NULL;
+}
+
+static int encode_rows_pipelined(JpegState *state)
+{
+    const int blocks_per_mcu = mcu_block_count(state);
+    const int num_workers = state->num_threads;
+
+    RowPipeline pipeline = {0};
+    pipeline.state = state;
+    pipeline.mcus_per_row = mcu_cols_of(state);
+    pipeline.mcu_rows = mcu_rows_of(state);
+    pipeline.depth = (uint32_t)num_workers * PIPELINE_ROWS_PER_THREAD;
+    pipeline.row_blocks = (size_t)pipeline.mcus_per_row * blocks_per_mcu;
+    pipeline.coefs = aligned_alloc64(pipeline.depth * pipeline.row_blocks * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+    pipeline.slot_row = malloc(pipeline.depth * sizeof(uint32_t));
+    RowWorker *workers = calloc(num_workers, sizeof(RowWorker));
+
+    int status = (pipeline.coefs && pipeline.slot_row && workers) ? 0 : -1;
+    for (int t = 0; t < num_workers && status == 0; t++)
+    {
+        workers[t].pipeline = &pipeline;
+        if (alloc_strip_buffers(state, &workers[t].strip, NULL) != 0)
+            status = -1;
+    }
+    if (status != 0)
+        goto cleanup;
+
+    for (uint32_t i = 0; i < pipeline.depth; i++)
+    {
+        pipeline.slot_row[i] = UINT32_MAX;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.row_ready, NULL);
+    pthread_cond_init(&pipeline.slot_free, NULL);
+
+    int started = 0;
+    for (int t = 0; t < num_workers; t++)
+    {
+        if (pthread_create(&workers[t].thread, NULL, row_worker_main, &workers[t]) != 0)
+            break;
+        started++;
+    }
+
+    // Entropy stage: rows are coded strictly in order, so the output does
+    // not depend on how many workers there are
+    JpegWriter *writer = &state->writer;
+    for (uint32_t row = 0; row < pipeline.mcu_rows && started > 0; row++)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        while (pipeline.slot_row[row % pipeline.depth] != row)
+        {
+            pthread_cond_wait(&pipeline.row_ready, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
+
+        const int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] =
+            (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])pipeline_slot(&pipeline, row);
+        for (uint32_t col = 0; col < pipeline.mcus_per_row; col++)
+        {
+            encode_mcu(state, writer, blocks + col * blocks_per_mcu);
+        }
+        flush_output(writer);
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.next_encode = row + 1;
+        if (writer->sink_error)
+            pipeline.abort = 1;
+        pthread_cond_broadcast(&pipeline.slot_free);
+        pthread_mutex_unlock(&pipeline.lock);
+        if (writer->sink_error)
+            break;
+    }
+    flush_bits(writer);
+
+    if (started == 0)
+        status = -1;
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+    pthread_cond_destroy(&pipeline.slot_free);
+    pthread_cond_destroy(&pipeline.row_ready);
+    pthread_mutex_destroy(&pipeline.lock);
+
+cleanup:
+    if (workers)
+    {
+        for (int t = 0; t < num_workers; t++)
+        {
+            free_strip_buffers(&workers[t].strip);
+        }
+    }
+    free(workers);
+    free(pipeline.slot_row);
+    free(pipeline.coefs);
+    return status;
+}
+
+// Initialize quantization tables with quality scaling
+static void init_quantization_tables(JpegState *state)
+{
+    double quality_scale;
+    if (state->quality < 50)
+        quality_scale = 50.0 / state->quality;
+    else
+        quality_scale = 2.0 - ((double)state->quality / 50.0);
+
+    // Scale luminance quantization table
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        for (int j = 0; j < BLOCK_SIZE; j++)
+        {
+            int value = (int)(STD_QUANT_TABLE_Y[i][j] * quality_scale);
+            state->quant_table_y[i * BLOCK_SIZE + j] =
+                (uint8_t)CLAMP(value, 1, 255);
+        }
+    }
+
+    // Scale chrominance quantization table
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        for (int j = 0; j < BLOCK_SIZE; j++)
+        {
+            int value = (int)(STD_QUANT_TABLE_C[i][j] * quality_scale);
+            state->quant_table_c[i * BLOCK_SIZE + j] =
+                (uint8_t)CLAMP(value, 1, 255);
+        }
+    }
+
+    // Reciprocals for the fused quantizer
+    init_quant_divisors(state->quant_table_y, &state->divisors_y);
+    init_quant_divisors(state->quant_table_c, &state->divisors_c);
+}
+
+void jpeg_cleanup(JpegState *state)
+{
+    if (!state)
+        return;
+
+    // Arena states own no heap memory
+    if (state->uses_arena)
+    {
+        if (state->outfile)
+            fclose(state->outfile);
+        state->outfile = NULL;
+        return;
+    }
+
+    free(state->writer.buffer);
+    state->writer.buffer = NULL;
+    free_previews(state);
+    if (state->rgb_data)
+    {
+        free(state->rgb_data);
+        state->rgb_data = NULL;
+    }
+    free_strip_buffers(&state->strip);
+    free(state->coef_buffer);
+    state->coef_buffer = NULL;
+    free(state->dct_buffer);
+    state->dct_buffer = NULL;
+    if (state->quant_table_y)
+    {
+        free(state->quant_table_y);
+        state->quant_table_y = NULL;
+    }
+    if (state->quant_table_c)
+    {
+        free(state->quant_table_c);
+        state->quant_table_c = NULL;
+    }
+
+    if (state->outfile)
+    {
+        fclose(state->outfile);
+        state->outfile = NULL;
+    }
+
+    free(state);
+}
+
+// Number of 8x8 blocks in the image, padded to whole MCUs
+static size_t image_block_count(const JpegState *state)
+{
+    const size_t total_mcus = (size_t)mcu_cols_of(state) * mcu_rows_of(state);
+    return total_mcus * mcu_block_count(state);
+}
+
+static void set_default_options(JpegState *state)
+{
+    state->chroma_layout = CHROMA_420;
+    state->gray_mode = GRAY_OFF;
+    state->num_components = 3;
+    state->dct_method = DCT_INT;
+    state->kernels = select_kernels();
+    state->restart_interval = 0;
+    state->num_threads = 1;
+}
+
+// Coefficient blocks an arena reserves: enough for 4:4:4, the layout with
+// the most blocks per pixel, so any layout or grayscale fits
+static size_t arena_coef_blocks(uint32_t width, uint32_t height)
+{
+    JpegState probe = {0};
+    set_default_options(&probe);
+    probe.width = width;
+    probe.height = height;
+    probe.chroma_layout = CHROMA_444;
+    return image_block_count(&probe);
+}
+
+// Prepare state for a new image, keeping its buffers and tables. Buffers
+// grow only when the image needs more room than any before it, and the
+// quantization tables are rebuilt only when the quality changes. Write the
+// new pixels into state->rgb_data afterwards, or push them as scanlines
+// on states made by jpeg_init_scanlines, which have no rgb_data. Arena
+// states cannot grow, so a larger image fails and leaves the state as it
+// was; for heap states a failure means the state must only be passed to
+// jpeg_cleanup.
+int jpeg_reset(JpegState *state, uint32_t width, uint32_t height, uint8_t quality)
+{
+    // Validate input parameters
+    if (!state || width == 0 || height == 0 || width > 65535 || height > 65535)
+        return -1;
+
+    // Quality should be between 1 and 100
+    if (quality < 1 || quality > 100)
+    {
+        quality = 75; // Default quality
+    }
+
+    // Strip planes depend only on the width, and wider strides serve
+    // narrower images as well
+    const size_t pixel_count = (size_t)width * height;
+    const int grow_rgb = !state->scanline_input && pixel_count > state->rgb_capacity;
+    const int grow_strip = !state->strip.plane_y || strip_stride(width) > state->strip.stride_y;
+    if (state->uses_arena && (grow_rgb || grow_strip))
+        return -1;
+    // Block buffers are sized for 4:4:4, like jpeg_arena_size does
+    if (state->uses_arena && ((state->coef_buffer && arena_coef_blocks(width, height) > state->coef_capacity) ||
+                              (state->dct_buffer && arena_coef_blocks(width, height) > state->dct_capacity)))
+        return -1;
+
+    if (grow_rgb)
+    {
+        RGB *rgb_data = realloc(state->rgb_data, pixel_count * sizeof(RGB));
+        if (!rgb_data)
+            return -1;
+        state->rgb_data = rgb_data;
+        state->rgb_capacity = pixel_count;
+    }
+
+    state->width = width;
+    state->height = height;
+
+    if (grow_strip)
+    {
+        free_strip_buffers(&state->strip);
+        if (alloc_strip_buffers(state, &state->strip, NULL) != 0)
+            return -1;
+    }
+
+    if (quality != state->quality)
+    {
+        state->quality = quality;
+        init_quantization_tables(state);
+    }
+
+    return 0;
+}
+
+// Exact number of bytes jpeg_init_arena needs for an image of this size,
+// encoded with the ArenaMode flags in modes. Those modes need whole-image
+// block buffers; without their flag they fail on an arena state before
+// anything is written.
+size_t jpeg_arena_size(uint32_t width, uint32_t height, unsigned modes)
+{
+    if (width == 0 || height == 0 || width > 65535 || height > 65535)
+        return 0;
+
+    JpegState probe = {0};
+    set_default_options(&probe);
+    probe.width = width;
+    probe.height = height;
+
+    StripBuffers strip;
+    size_t strip_sizes[4];
+    strip_layout(&probe, &strip, strip_sizes);
+
+    size_t size = ARENA_ALIGN - 1; // The arena itself may be misaligned
+    size += arena_footprint(sizeof(JpegState));
+    size += arena_footprint(OUTPUT_BUFFER_SIZE);
+    size += 2 * arena_footprint(BLOCK_SIZE * BLOCK_SIZE); // Quantization tables
+    size += arena_footprint((size_t)width * height * sizeof(RGB));
+    for (int i = 0; i < 4; i++)
+    {
+        size += arena_footprint(strip_sizes[i]);
+    }
+    const size_t blocks_size = arena_coef_blocks(width, height) * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t);
+    if (modes & (ARENA_OPTIMIZE | ARENA_PROGRESSIVE | ARENA_TARGET_SIZE))
+        size += arena_footprint(blocks_size); // coef_buffer
+    if (modes & ARENA_TARGET_SIZE)
+        size += arena_footprint(blocks_size); // dct_buffer
+
+    return size;
+}
+
+// Build a state whose buffers, the state included, are all carved from the
+// caller's arena of arena_size bytes (see jpeg_arena_size). Neither this
+// nor later encodes touch the heap: encodes run on the calling thread
+// whatever num_threads says, jpeg_reset fails for images that need more
+// room, and jpeg_cleanup only closes a file left open. ARENA_OPTIMIZE and
+// ARENA_PROGRESSIVE in modes also turn those modes on; target_size is left
+// for the caller to set. The arena must outlive the state. Returns NULL if
+// the arena is too small.
+JpegState *jpeg_init_arena(void *memory, size_t arena_size, uint32_t width, uint32_t height,
+                           uint8_t quality, unsigned modes)
+{
+    if (!memory || jpeg_arena_size(width, height, modes) == 0)
+        return NULL;
+
+    Arena arena = {memory, (uint8_t *)memory + arena_size};
+    JpegState *state = arena_alloc(&arena, sizeof(JpegState));
+    if (!state)
+        return NULL;
+
+    memset(state, 0, sizeof(*state));
+    set_default_options(state);
+    state->uses_arena = 1;
+    state->optimize_coding = (modes & ARENA_OPTIMIZE) != 0;
+    state->progressive = (modes & ARENA_PROGRESSIVE) != 0;
+    state->width = width;
+    state->height = height;
+
+    state->writer.buffer = arena_alloc(&arena, OUTPUT_BUFFER_SIZE);
+    state->writer.buffer_size = OUTPUT_BUFFER_SIZE;
+    state->quant_table_y = arena_alloc(&arena, BLOCK_SIZE * BLOCK_SIZE);
+    state->quant_table_c = arena_alloc(&arena, BLOCK_SIZE * BLOCK_SIZE);
+    state->rgb_data = arena_alloc(&arena, (size_t)width * height * sizeof(RGB));
+    state->rgb_capacity = (size_t)width * height;
+    if (!state->writer.buffer || !state->quant_table_y || !state->quant_table_c || !state->rgb_data)
+        return NULL;
+
+    if (alloc_strip_buffers(state, &state->strip, &arena) != 0)
+        return NULL;
+
+    const size_t blocks = arena_coef_blocks(width, height);
+    if (modes & (ARENA_OPTIMIZE | ARENA_PROGRESSIVE | ARENA_TARGET_SIZE))
+    {
+        state->coef_capacity = blocks;
+        state->coef_buffer = arena_alloc(&arena, blocks * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+        if (!state->coef_buffer)
+            return NULL;
+    }
+    if (modes & ARENA_TARGET_SIZE)
+    {
+        state->dct_capacity = blocks;
+        state->dct_buffer = arena_alloc(&arena, blocks * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+        if (!state->dct_buffer)
+            return NULL;
+    }
+
+    if (init_huffman_tables(state) != 0 || jpeg_reset(state, width, height, quality) != 0)
+        return NULL;
+
+    return state;
+}
+
+static JpegState *create_state(uint32_t width, uint32_t height, uint8_t quality, int scanline_input)
+{
+    JpegState *state = calloc(1, sizeof(JpegState));
+    if (!state)
+        return NULL;
+
+    set_default_options(state);
+    state->scanline_input = scanline_input;
+
+    // Allocate the buffers that do not depend on the image
+    state->writer.buffer = malloc(OUTPUT_BUFFER_SIZE);
+    state->writer.buffer_size = OUTPUT_BUFFER_SIZE;
+    state->quant_table_y = malloc(BLOCK_SIZE * BLOCK_SIZE);
+    state->quant_table_c = malloc(BLOCK_SIZE * BLOCK_SIZE);
+    if (!state->writer.buffer || !state->quant_table_y || !state->quant_table_c)
+        goto cleanup;
+
+    // Initialize Huffman tables
+    if (init_huffman_tables(state) != 0)
+        goto cleanup;
+
+    // Image buffers and quantization tables (quality 0 forces the latter)
+    if (jpeg_reset(state, width, height, quality) != 0)
+        goto cleanup;
+
+    return state;
+
+cleanup:
+    jpeg_cleanup(state);
+    return NULL;
+}
+
+// Initialize JPEG compression state
+JpegState *jpeg_init(uint32_t width, uint32_t height, uint8_t quality)
+{
+    return create_state(width, height, quality, 0);
+}
+
+// Initialize a state that takes its pixels row by row through
+// jpeg_push_scanlines instead of from a whole-image rgb_data, so its
+// memory grows with the width only (unless an encode mode needs the whole
+// image, such as optimize_coding)
+JpegState *jpeg_init_scanlines(uint32_t width, uint32_t height, uint8_t quality)
+{
+    return create_state(width, height, quality, 1);
+}
+
+// Write Start of Frame, baseline (SOF0) or progressive (SOF2)
+void write_sof(JpegState *state)
+{
+    write_marker(state, state->progressive ? MARKER_SOF2 : MARKER_SOF0);
+    write_word(state, 8 + 3 * state->num_components); // Length
+    write_byte(state, 8);                              // Precision
+    write_word(state, state->height);
+    write_word(state, state->width);
+    write_byte(state, state->num_components); // Number of components
+
+    // Y component
+    write_byte(state, 1);                                             // Component ID
+    write_byte(state, mcu_h_factor(state) << 4 | mcu_v_factor(state)); // Sampling factors
+    write_byte(state, 0);                                             // Quant table ID
+    if (state->num_components == 1)
+        return;
+
+    // Cb component
+    write_byte(state, 2);    // Component ID
+    write_byte(state, 0x11); // Sampling factors (1x1)
+    write_byte(state, 1);    // Quant table ID
+
+    // Cr component
+    write_byte(state, 3);    // Component ID
+    write_byte(state, 0x11); // Sampling factors (1x1)
+    write_byte(state, 1);    // Quant table ID
+}
+
+// Write quantization tables
+void write_dqt(JpegState *state)
+{
+    // Write marker and length
+    write_marker(state, MARKER_DQT);
+    write_word(state, 2 + (state->num_components == 1 ? 1 : 2) * (1 + 64)); // Length
+
+    // Write luminance table
+    write_byte(state, 0x00); // Table ID 0, precision 8-bit
+    for (int i = 0; i < 64; i++)
+    {
+        write_byte(state, state->quant_table_y[ZIGZAG_PATTERN[i][0] * 8 +
+                                               ZIGZAG_PATTERN[i][1]]);
+    }
+    if (state->num_components == 1)
+        return;
+
+    // Write chrominance table
+    write_byte(state, 0x01); // Table ID 1, precision 8-bit
+    for (int i = 0; i < 64; i++)
+    {
+        write_byte(state, state->quant_table_c[ZIGZAG_PATTERN[i][0] * 8 +
+                                               ZIGZAG_PATTERN[i][1]]);
+    }
+}
+
+// Write JPEG file header
+void write_jpeg_header(JpegState *state)
+{
+    // Write SOI marker
+    write_marker(state, MARKER_SOI);
+
+    // Write JFIF APP0 marker
+    write_app0(state);
+
+    // Write quantization tables
+    write_dqt(state);
+
+    // Write Start of Frame
+    write_sof(state);
+
+    // Write Huffman tables; each progressive scan brings its own
+    if (!state->progressive)
+        write_dht(state, state->num_components == 3 ? 0xF : 0x3);
+
+    // Write restart interval
+    if (state->restart_interval > 0)
+        write_dri(state);
+
+    // Write Start of Scan: baseline has a single scan of everything, the
+    // progressive scans are started by encode_progressive
+    if (!state->progressive)
+    {
+        const JpegScan scan = {state->num_components, {0, 1, 2}, 0, BLOCK_SIZE * BLOCK_SIZE - 1, 0, 0};
+        write_sos(state, &scan);
+    }
+}
+
+// Write JPEG file trailer
+void write_jpeg_trailer(JpegState *state)
+{
+    // Write End of Image marker
+    write_marker(state, MARKER_EOI);
+}
+
+// Whole-image block buffer for the given number of blocks, kept in state
+// and grown only when an image needs more
+static int16_t *reserve_blocks(JpegState *state, int16_t **buffer, size_t *capacity, size_t blocks)
+{
+    if (blocks > *capacity)
+    {
+        if (state->uses_arena)
+            return NULL;
+
+        free(*buffer);
+        *buffer = aligned_alloc64(blocks * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+        *capacity = *buffer ? blocks : 0;
+    }
+    return *buffer;
+}
+
+// Whether the whole-image modes keep the unquantized blocks, to quantize
+// them at several qualities
+static inline int keeps_unquantized(const JpegState *state)
+{
+    return state->target_size || state->ladder_count;
+}
+
+static int16_t *reserve_coef_buffer(JpegState *state, size_t blocks)
+{
+    return reserve_blocks(state, &state->coef_buffer, &state->coef_capacity, blocks);
+}
+
+// Buffers of the whole-image modes: quantized coefficients, plus the
+// unquantized ones for target sizes and ladders
+static int reserve_image_buffers(JpegState *state)
+{
+    const size_t blocks = image_block_count(state);
+    if (!reserve_coef_buffer(state, blocks))
+        return -1;
+    if (keeps_unquantized(state) && !reserve_blocks(state, &state->dct_buffer, &state->dct_capacity, blocks))
+        return -1;
+    return 0;
+}
+
+// Optimize mode: the whole image is transformed and quantized once into a
+// coefficient buffer, symbol statistics are gathered from it, and it is
+// then entropy coded with Huffman tables built for those statistics.
+// Target size and ladder modes keep the unquantized blocks instead (see
+// fit_target_size and encode_ladder).
+static void buffer_strip(JpegState *state, uint32_t row)
+{
+    const uint32_t mcu_width = mcu_width_of(state);
+    const uint32_t mcus_per_row = mcu_cols_of(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+    const size_t first = (size_t)row * mcus_per_row * blocks_per_mcu;
+
+    if (keeps_unquantized(state))
+    {
+        int16_t (*coefs)[BLOCK_SIZE * BLOCK_SIZE] = (int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])state->dct_buffer + first;
+        for (uint32_t col = 0; col < mcus_per_row; col++, coefs += blocks_per_mcu)
+        {
+            transform_mcu(state, &state->strip, col * mcu_width, coefs);
+        }
+        return;
+    }
+
+    int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = (int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])state->coef_buffer + first;
+    for (uint32_t col = 0; col < mcus_per_row; col++, blocks += blocks_per_mcu)
+    {
+        analyze_mcu(state, &state->strip, col * mcu_width, blocks);
+    }
+}
+
+static void analyze_image(JpegState *state)
+{
+    const uint32_t mcu_height = mcu_height_of(state);
+    const uint32_t mcu_rows = mcu_rows_of(state);
+
+    for (uint32_t row = 0; row < mcu_rows; row++)
+    {
+        convert_strip(state, &state->strip, row * mcu_height);
+        state->strip.mcu_row = row;
+        buffer_strip(state, row);
+    }
+}
+
+// Replace the Huffman tables with ones built from the image's statistics,
+// following the same restart segmentation as the encode
+static void optimize_huffman_tables(JpegState *state, const int16_t *coefs, uint32_t total_mcus)
+{
+    const int luma_blocks = mcu_luma_blocks(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+    const int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])coefs;
+    uint32_t freq[4][256] = {{0}}; // DC Y, AC Y, DC C, AC C
+    int16_t last_dc[3] = {0};
+
+    for (uint32_t m = 0; m < total_mcus; m++, blocks += blocks_per_mcu)
+    {
+        if (state->restart_interval && m % state->restart_interval == 0)
+            memset(last_dc, 0, sizeof(last_dc));
+
+        for (int i = 0; i < luma_blocks; i++)
+        {
+            count_block_symbols(blocks[i], &last_dc[0], freq[0], freq[1]);
+        }
+        if (state->num_components == 1)
+            continue;
+        count_block_symbols(blocks[luma_blocks], &last_dc[1], freq[2], freq[3]);
+        count_block_symbols(blocks[luma_blocks + 1], &last_dc[2], freq[2], freq[3]);
+    }
+
+    build_huffman_spec(freq[0], &state->dc_spec_y);
+    build_huffman_spec(freq[1], &state->ac_spec_y);
+    if (state->num_components == 3)
+    {
+        build_huffman_spec(freq[2], &state->dc_spec_c);
+        build_huffman_spec(freq[3], &state->ac_spec_c);
+    }
+    build_huffman_tables(state);
+}
+
+static void encode_image_coefficients(JpegState *state, const int16_t *coefs, uint32_t total_mcus)
+{
+    const uint32_t mcus_per_row = mcu_cols_of(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+    const int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])coefs;
+    const uint32_t interval = state->restart_interval;
+    JpegWriter *writer = &state->writer;
+
+    for (uint32_t m = 0; m < total_mcus && !writer->sink_error; m++, blocks += blocks_per_mcu)
+    {
+        if (interval && m > 0 && m % interval == 0)
+        {
+            flush_bits(writer);
+            write_marker(state, MARKER_RST0 + ((m / interval - 1) & 7));
+            memset(writer->last_dc, 0, sizeof(writer->last_dc));
+        }
+
+        encode_mcu(state, writer, blocks);
+        if ((m + 1) % mcus_per_row == 0)
+            flush_output(writer);
+    }
+
+    flush_bits(writer);
+}
+
+// Progressive mode (Annex G): the quantized coefficients are buffered as
+// in optimize mode and every scan of the script is coded from the buffer,
+// so the DCT runs once however many scans there are. Each scan gets
+// Huffman tables built for it by a counting pass over the same blocks,
+// which the standard tables could not serve anyway: they have no codes
+// for EOB runs.
+#define MAX_EOBRUN 0x7FFF
+#define MAX_CORRECTION_BITS 1000 // Refinement bits held back for an EOB run
+
+// Default script, after libjpeg's: a DC scan and the low luma band make
+// the first preview, and the bulky low bits of luma come last. Grayscale
+// encodes drop the chroma parts.
+static const JpegScan DEFAULT_SCAN_SCRIPT[] = {
+    {3, {0, 1, 2}, 0, 0, 0, 1},
+    {1, {0}, 1, 5, 0, 2},
+    {1, {2}, 1, 63, 0, 1},
+    {1, {1}, 1, 63, 0, 1},
+    {1, {0}, 6, 63, 0, 2},
+    {1, {0}, 1, 63, 2, 1},
+    {3, {0, 1, 2}, 0, 0, 1, 0},
+    {1, {2}, 1, 63, 1, 0},
+    {1, {1}, 1, 63, 1, 0},
+    {1, {0}, 1, 63, 1, 0},
+};
+
+// Check a script against the rules of G.1.1.1: DC scans never carry AC
+// coefficients, AC scans code a single component that already has its DC,
+// and refinements lower the bit position one at a time. The script must
+// also send every coefficient of Y, Cb and Cr down to bit 0.
+static int validate_scan_script(const JpegScan *scans, int num_scans)
+{
+    int8_t sent[3][BLOCK_SIZE * BLOCK_SIZE]; // Lowest bit sent so far, -1 if none
+    memset(sent, -1, sizeof(sent));
+
+    if (num_scans < 1 || num_scans > MAX_SCANS)
+        return -1;
+
+    for (int s = 0; s < num_scans; s++)
+    {
+        const JpegScan *scan = &scans[s];
+        if (scan->component_count < 1 || scan->component_count > 3)
+            return -1;
+        if (scan->ss > scan->se || scan->se >= BLOCK_SIZE * BLOCK_SIZE || scan->ah > 13 || scan->al > 13)
+            return -1;
+        if ((scan->ss == 0 && scan->se != 0) || (scan->ss > 0 && scan->component_count != 1))
+            return -1;
+
+        for (int i = 0; i < scan->component_count; i++)
+        {
+            const int c = scan->components[i];
+            if (c > 2 || (i > 0 && c <= scan->components[i - 1]))
+                return -1;
+            if (scan->ss > 0 && sent[c][0] < 0)
+                return -1;
+            for (int k = scan->ss; k <= scan->se; k++)
+            {
+                if (scan->ah == 0 ? sent[c][k] >= 0 : sent[c][k] != scan->ah || scan->al != scan->ah - 1)
+                    return -1;
+                sent[c][k] = (int8_t)scan->al;
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        for (int k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+        {
+            if (sent[c][k] != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Use scans as the script of progressive encodes; NULL restores the
+// default. Scripts are written for Y, Cb and Cr and grayscale encodes
+// skip the chroma parts. Returns -1 if the script is invalid.
+int jpeg_set_scan_script(JpegState *state, const JpegScan *scans, int num_scans)
+{
+    if (!state)
+        return -1;
+    if (!scans)
+    {
+        state->num_scans = 0;
+        return 0;
+    }
+    if (validate_scan_script(scans, num_scans) != 0)
+        return -1;
+
+    memcpy(state->scan_script, scans, num_scans * sizeof(*scans));
+    state->num_scans = num_scans;
+    return 0;
+}
+
+#ifndef JPEG_NO_MAIN
+// Parse a scan script from its text form: scans separated by ';', each
+// written "components: Ss-Se, Ah, Al" with the components as a comma
+// separated list of 0 (Y), 1 (Cb) and 2 (Cr), e.g. "0,1,2: 0-0, 0, 0"
+static int parse_scan_script(const char *text, JpegScan scans[MAX_SCANS], int *num_scans)
+{
+    int count = 0;
+    while (*text)
+    {
+        if (count == MAX_SCANS)
+            return -1;
+        JpegScan *scan = &scans[count++];
+        memset(scan, 0, sizeof(*scan));
+
+        for (;;)
+        {
+            char *end;
+            const long component = strtol(text, &end, 10);
+            if (end == text || component < 0 || component > 2 || scan->component_count == 3)
+                return -1;
+            scan->components[scan->component_count++] = (uint8_t)component;
+            text = end;
+            if (*text != ',')
+                break;
+            text++;
+        }
+
+        int ss, se, ah, al, used = 0;
+        if (sscanf(text, " : %d - %d , %d , %d %n", &ss, &se, &ah, &al, &used) != 4 || used == 0)
+            return -1;
+        if (ss < 0 || se > 63 || ah < 0 || ah > 13 || al < 0 || al > 13)
+            return -1;
+        scan->ss = (uint8_t)ss;
+        scan->se = (uint8_t)se;
+        scan->ah = (uint8_t)ah;
+        scan->al = (uint8_t)al;
+
+        text += used;
+        if (*text == ';')
+            text++;
+        else if (*text)
+            return -1;
+    }
+
+    *num_scans = count;
+    return count > 0 ? 0 : -1;
+}
+#endif // JPEG_NO_MAIN
+
+// The scans of the current encode, without components it does not have
+static int active_scan_script(const JpegState *state, JpegScan scans[MAX_SCANS])
+{
+    const JpegScan *script = state->num_scans ? state->scan_script : DEFAULT_SCAN_SCRIPT;
+    const int count = state->num_scans ? state->num_scans
+                                       : (int)(sizeof(DEFAULT_SCAN_SCRIPT) / sizeof(DEFAULT_SCAN_SCRIPT[0]));
+    int num_scans = 0;
+
+    for (int s = 0; s < count; s++)
+    {
+        JpegScan scan = script[s];
+        scan.component_count = 0;
+        for (int i = 0; i < script[s].component_count; i++)
+        {
+            if (script[s].components[i] < state->num_components)
+                scan.components[scan.component_count++] = script[s].components[i];
+        }
+        if (scan.component_count > 0)
+            scans[num_scans++] = scan;
+    }
+    return num_scans;
+}
+
+// Entropy coder of one progressive scan. With freq set it only counts the
+// symbols it would emit, for building the scan's tables, and writes nothing.
+typedef struct
+{
+    JpegWriter *writer;
+    const HuffmanTable *tables[4]; // DC Y, AC Y, DC C, AC C
+    uint32_t (*freq)[256];         // Symbol counts in the same order, or NULL
+    int ss, se, al;
+    int ac_table; // Index of the scan's AC table
+    int16_t last_dc[3];
+    uint32_t eobrun;      // Blocks in the pending EOB run
+    int correction_count; // Correction bits of the blocks in the EOB run
+    uint8_t correction[MAX_CORRECTION_BITS];
+} ScanCoder;
+
+typedef void (*ScanBlockFn)(ScanCoder *coder, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int component);
+
+// Table index of a component's DC (ac = 0) or AC (ac = 1) table
+static inline int scan_table(int component, int ac)
+{
+    return (component ? 2 : 0) + ac;
+}
+
+static inline void scan_emit(ScanCoder *coder, int table, int symbol, uint32_t amplitude, int nbits)
+{
+    if (coder->freq)
+        coder->freq[table][symbol]++;
+    else
+        emit_symbol(coder->writer, coder->tables[table], symbol, amplitude, nbits);
+}
+
+static void emit_correction_bits(ScanCoder *coder, const uint8_t *bits, int count)
+{
+    if (coder->freq)
+        return;
+    for (int i = 0; i < count; i++)
+    {
+        write_bits(coder->writer, bits[i], 1);
+    }
+}
+
+// Code the pending run of blocks with nothing left in the band (EOBn),
+// followed by the correction bits held back for them
+static void emit_eobrun(ScanCoder *coder)
+{
+    if (coder->eobrun == 0)
+        return;
+
+    const int nbits = magnitude_category(coder->eobrun) - 1;
+    scan_emit(coder, coder->ac_table, nbits << 4, coder->eobrun & ((1u << nbits) - 1), nbits);
+    emit_correction_bits(coder, coder->correction, coder->correction_count);
+    coder->eobrun = 0;
+    coder->correction_count = 0;
+}
+
+// First DC scan: the DC difference of the coefficients shifted down by al
+static void encode_dc_first(ScanCoder *coder, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int component)
+{
+    const int dc = zigzag[0] >> coder->al;
+    const int value = dc - coder->last_dc[component];
+    coder->last_dc[component] = (int16_t)dc;
+
+    const int sign = value >> 31;
+    const int nbits = magnitude_category((uint32_t)((value ^ sign) - sign));
+    scan_emit(coder, scan_table(component, 0), nbits, (uint32_t)(value + sign) & ((1u << nbits) - 1), nbits);
+}
+
+// DC refinement: the next bit of the coefficient, uncoded
+static void encode_dc_refine(ScanCoder *coder, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int component)
+{
+    (void)component;
+    if (!coder->freq)
+        write_bits(coder->writer, (zigzag[0] >> coder->al) & 1, 1);
+}
+
+// First AC scan of a band: baseline AC coding of the magnitudes shifted
+// down by al, except that the EOBs of consecutive blocks join into runs
+static void encode_ac_first(ScanCoder *coder, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int component)
+{
+    (void)component;
+    int run = 0;
+    for (int k = coder->ss; k <= coder->se; k++)
+    {
+        const int value = zigzag[k];
+        const int sign = value >> 31;
+        const int magnitude = ((value ^ sign) - sign) >> coder->al;
+        if (magnitude == 0)
+        {
+            run++;
+            continue;
+        }
+
+        emit_eobrun(coder);
+        while (run > 15)
+        {
+            scan_emit(coder, coder->ac_table, 0xF0, 0, 0); // ZRL
+            run -= 16;
+        }
+
+        // Negative values are sent as the one's complement of the magnitude
+        const int nbits = magnitude_category((uint32_t)magnitude);
+        scan_emit(coder, coder->ac_table, (run << 4) | nbits, (uint32_t)(magnitude ^ sign) & ((1u << nbits) - 1), nbits);
+        run = 0;
+    }
+
+    if (run > 0 && ++coder->eobrun == MAX_EOBRUN)
+        emit_eobrun(coder);
+}
+
+// AC refinement (G.1.2.3): coefficients that become nonzero at bit al are
+// coded with their sign as in a first scan of magnitude 1, and those
+// already nonzero contribute one correction bit each, sent after the next
+// coded symbol. Runs count only the coefficients that are still zero.
+static void encode_ac_refine(ScanCoder *coder, const int16_t zigzag[BLOCK_SIZE * BLOCK_SIZE], int component)
+{
+    (void)component;
+    int magnitudes[BLOCK_SIZE * BLOCK_SIZE];
+    int last_new = 0; // Position of the last newly nonzero coefficient
+    for (int k = coder->ss; k <= coder->se; k++)
+    {
+        const int value = zigzag[k];
+        const int sign = value >> 31;
+        magnitudes[k] = ((value ^ sign) - sign) >> coder->al;
+        if (magnitudes[k] == 1)
+            last_new = k;
+    }
+
+    // This block's correction bits follow those of the pending EOB run
+    uint8_t *bits = coder->correction + coder->correction_count;
+    int bit_count = 0;
+    int run = 0;
+    for (int k = coder->ss; k <= coder->se; k++)
+    {
+        if (magnitudes[k] == 0)
+        {
+            run++;
+            continue;
+        }
+
+        // ZRLs past the last new coefficient fold into the EOB
+        while (run > 15 && k <= last_new)
+        {
+            emit_eobrun(coder);
+            scan_emit(coder, coder->ac_table, 0xF0, 0, 0); // ZRL
+            run -= 16;
+            emit_correction_bits(coder, bits, bit_count);
+            bits = coder->correction;
+            bit_count = 0;
+        }
+
+        if (magnitudes[k] > 1)
+        {
+            bits[bit_count++] = magnitudes[k] & 1;
+            continue;
+        }
+
+        emit_eobrun(coder);
+        scan_emit(coder, coder->ac_table, (run << 4) | 1, zigzag[k] >= 0, 1);
+        emit_correction_bits(coder, bits, bit_count);
+        bits = coder->correction;
+        bit_count = 0;
+        run = 0;
+    }
+
+    if (run > 0 || bit_count > 0)
+    {
+        coder->eobrun++;
+        coder->correction_count += bit_count;
+        if (coder->eobrun == MAX_EOBRUN || coder->correction_count > MAX_CORRECTION_BITS - BLOCK_SIZE * BLOCK_SIZE + 1)
+            emit_eobrun(coder);
+    }
+}
+
+// Address of block (bx, by) of a component in the MCU-ordered buffer
+static const int16_t *component_block(const JpegState *state, const int16_t *coefs, int component,
+                                      uint32_t bx, uint32_t by)
+{
+    size_t mcu;
+    int index;
+    if (component == 0)
+    {
+        const uint32_t h = mcu_h_factor(state);
+        const uint32_t v = mcu_v_factor(state);
+        mcu = (size_t)(by / v) * mcu_cols_of(state) + bx / h;
+        index = (int)((by % v) * h + bx % h);
+    }
+    else
+    {
+        mcu = (size_t)by * mcu_cols_of(state) + bx;
+        index = mcu_luma_blocks(state) + component - 1;
+    }
+    return coefs + (mcu * mcu_block_count(state) + index) * BLOCK_SIZE * BLOCK_SIZE;
+}
+
+static void start_scan_coder(ScanCoder *coder, const JpegScan *scan, uint32_t (*freq)[256])
+{
+    coder->freq = freq;
+    coder->ss = scan->ss;
+    coder->se = scan->se;
+    coder->al = scan->al;
+    coder->ac_table = scan_table(scan->components[0], 1);
+    memset(coder->last_dc, 0, sizeof(coder->last_dc));
+    coder->eobrun = 0;
+    coder->correction_count = 0;
+}
+
+// Code one scan from the coefficient buffer. Scans of several components
+// (DC only) go MCU by MCU; a single-component scan covers only that
+// component's own blocks, without the MCU padding (A.2.2), and its
+// restart interval counts blocks.
+static void code_scan(JpegState *state, const JpegScan *scan, const int16_t *coefs, ScanCoder *coder)
+{
+    const ScanBlockFn code_block = scan->ss == 0 ? (scan->ah ? encode_dc_refine : encode_dc_first)
+                                                 : (scan->ah ? encode_ac_refine : encode_ac_first);
+    const int interleaved = scan->component_count > 1;
+    const int first = scan->components[0];
+    const uint32_t h = mcu_h_factor(state);
+    const uint32_t v = mcu_v_factor(state);
+    const uint32_t cols = interleaved || first > 0 ? mcu_cols_of(state) : (state->width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const uint32_t rows = interleaved || first > 0 ? mcu_rows_of(state) : (state->height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const uint32_t interval = state->restart_interval;
+    const int writing = !coder->freq;
+    JpegWriter *writer = coder->writer;
+
+    uint32_t unit = 0;
+    for (uint32_t row = 0; row < rows && !writer->sink_error; row++)
+    {
+        for (uint32_t col = 0; col < cols; col++, unit++)
+        {
+            if (interval && unit > 0 && unit % interval == 0)
+            {
+                emit_eobrun(coder);
+                memset(coder->last_dc, 0, sizeof(coder->last_dc));
+                if (writing)
+                {
+                    flush_bits(writer);
+                    write_marker(state, MARKER_RST0 + ((unit / interval - 1) & 7));
+                }
+            }
+
+            if (!interleaved)
+            {
+                code_block(coder, component_block(state, coefs, first, col, row), first);
+                continue;
+            }
+            for (int i = 0; i < scan->component_count; i++)
+            {
+                const int c = scan->components[i];
+                if (c > 0)
+                {
+                    code_block(coder, component_block(state, coefs, c, col, row), c);
+                    continue;
+                }
+                for (uint32_t by = 0; by < v; by++)
+                {
+                    for (uint32_t bx = 0; bx < h; bx++)
+                    {
+                        code_block(coder, component_block(state, coefs, 0, col * h + bx, row * v + by), 0);
+                    }
+                }
+            }
+        }
+        if (writing)
+            flush_output(writer);
+    }
+
+    emit_eobrun(coder);
+    if (writing)
+        flush_bits(writer);
+}
+
+// Write every scan of the script, each preceded by its own tables
+static void encode_progressive(JpegState *state, const int16_t *coefs)
+{
+    HuffmanSpec *specs[4] = {&state->dc_spec_y, &state->ac_spec_y, &state->dc_spec_c, &state->ac_spec_c};
+    JpegScan scans[MAX_SCANS];
+    const int num_scans = active_scan_script(state, scans);
+    ScanCoder coder = {.writer = &state->writer,
+                       .tables = {&state->dc_table_y, &state->ac_table_y, &state->dc_table_c, &state->ac_table_c}};
+
+    for (int s = 0; s < num_scans && !state->writer.sink_error; s++)
+    {
+        const JpegScan *scan = &scans[s];
+
+        // Tables the scan codes with; DC refinement needs none
+        unsigned tables = 0;
+        if (scan->ss > 0)
+            tables = 1u << scan_table(scan->components[0], 1);
+        else if (scan->ah == 0)
+        {
+            for (int i = 0; i < scan->component_count; i++)
+            {
+                tables |= 1u << scan_table(scan->components[i], 0);
+            }
+        }
+
+        if (tables)
+        {
+            uint32_t freq[4][256] = {{0}};
+            start_scan_coder(&coder, scan, freq);
+            code_scan(state, scan, coefs, &coder);
+            for (int t = 0; t < 4; t++)
+            {
+                if (tables & (1u << t))
+                    build_huffman_spec(freq[t], specs[t]);
+            }
+            build_huffman_tables(state);
+            write_dht(state, tables);
+        }
+
+        write_sos(state, scan);
+        start_scan_coder(&coder, scan, NULL);
+        code_scan(state, scan, coefs, &coder);
+    }
+}
+
+// Write the header and entropy-coded data of an image whose coefficients
+// are all in coefs: the progressive scans, or one baseline scan with
+// tables built for the image in optimize mode
+static void write_buffered_image(JpegState *state, const int16_t *coefs, uint32_t total_mcus)
+{
+    if (state->progressive)
+    {
+        write_jpeg_header(state);
+        encode_progressive(state, coefs);
+    }
+    else
+    {
+        if (state->optimize_coding)
+            optimize_huffman_tables(state, coefs, total_mcus);
+        write_jpeg_header(state);
+        encode_image_coefficients(state, coefs, total_mcus);
+    }
+
+    // Later encodes start from the standard tables again
+    if (state->progressive || state->optimize_coding)
+        init_huffman_tables(state);
+}
+
+// Whether encodes go through the whole-image coefficient buffer
+static inline int buffers_coefficients(const JpegState *state)
+{
+    return state->optimize_coding || state->progressive || keeps_unquantized(state);
+}
+
+// Target size mode: the image is transformed once into dct_buffer and each
+// quality tried only requantizes it into coef_buffer and entropy codes the
+// result into a sink that counts bytes. A binary search settles on the
+// highest quality, up to state->quality, whose output fits target_size,
+// or quality 1 if none does.
+static int count_sink_write(void *opaque, const uint8_t *data, size_t size)
+{
+    (void)data;
+    *(size_t *)opaque += size;
+    return 0;
+}
+
+static void quantize_image(JpegState *state, uint32_t total_mcus)
+{
+    const int luma_blocks = mcu_luma_blocks(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+    const int16_t (*coefs)[BLOCK_SIZE * BLOCK_SIZE] = (const int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])state->dct_buffer;
+    int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = (int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])state->coef_buffer;
+
+    for (uint32_t m = 0; m < total_mcus; m++)
+    {
+        for (int i = 0; i < blocks_per_mcu; i++, coefs++, blocks++)
+        {
+            state->kernels->quantize_zigzag(*coefs, i < luma_blocks ? &state->divisors_y : &state->divisors_c,
+                                            *blocks);
+        }
+    }
+}
+
+static void set_quality(JpegState *state, uint8_t quality, uint32_t total_mcus)
+{
+    state->quality = quality;
+    init_quantization_tables(state);
+    quantize_image(state, total_mcus);
+}
+
+// Size of the whole file at the quality coef_buffer holds
+static size_t encoded_size(JpegState *state, uint32_t total_mcus)
+{
+    size_t size = 0;
+    const JpegSink counter = {count_sink_write, &size};
+    init_writer(&state->writer, counter, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+    write_buffered_image(state, state->coef_buffer, total_mcus);
+    write_jpeg_trailer(state);
+    flush_output(&state->writer);
+    return size;
+}
+
+// Leave coef_buffer and the quantization tables at the chosen quality
+static void fit_target_size(JpegState *state, uint32_t total_mcus)
+{
+    const JpegSink sink = state->writer.sink;
+    int low = 1, high = state->quality, best = 0;
+
+    // The requested quality first: it often fits already
+    int quality = high;
+    while (low <= high)
+    {
+        set_quality(state, (uint8_t)quality, total_mcus);
+        if (encoded_size(state, total_mcus) <= state->target_size)
+        {
+            best = quality;
+            low = quality + 1;
+        }
+        else
+        {
+            high = quality - 1;
+        }
+        quality = (low + high) / 2;
+    }
+
+    if (best == 0)
+        best = 1;
+    if (best != state->quality)
+        set_quality(state, (uint8_t)best, total_mcus);
+    state->fitted_quality = (uint8_t)best;
+
+    init_writer(&state->writer, sink, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+}
+
+// Write the main output of an image held in the whole-image buffers,
+// fitting it to the target size first if one is set
+static void write_main_image(JpegState *state, uint32_t total_mcus)
+{
+    if (!state->target_size)
+    {
+        // With a ladder only the unquantized blocks were kept
+        if (state->ladder_count)
+            quantize_image(state, total_mcus);
+        write_buffered_image(state, state->coef_buffer, total_mcus);
+        return;
+    }
+
+    const uint8_t quality = state->quality;
+    fit_target_size(state, total_mcus);
+    write_buffered_image(state, state->coef_buffer, total_mcus);
+
+    state->quality = quality;
+    init_quantization_tables(state);
+}
+
+// Quality ladder: extra outputs of the same image at other qualities
+// (jpeg_set_ladder). The image is analyzed once into dct_buffer; each rung
+// is a copy of the state with its own tables, output buffer and
+// coefficient buffer, so it only quantizes and entropy codes. The calling
+// thread writes the main output and worker threads take the rungs, up to
+// num_threads in all. The outputs do not depend on the thread count.
+typedef struct
+{
+    JpegState state;
+    JpegSink sink;
+    int status;
+} LadderRung;
+
+typedef struct
+{
+    LadderRung *rungs;
+    int count;
+    uint32_t total_mcus;
+    int next; // Next rung to claim, updated atomically
+} LadderJobs;
+
+static int init_ladder_rung(LadderRung *rung, const JpegState *state, const JpegRung *spec)
+{
+    const size_t blocks = image_block_count(state);
+    JpegState *copy = &rung->state;
+
+    *copy = *state;
+    copy->quality = spec->quality >= 1 && spec->quality <= 100 ? spec->quality : 75;
+    copy->target_size = 0;
+    copy->ladder = NULL;
+    copy->ladder_count = 0;
+    copy->rgb_data = NULL;
+    copy->outfile = NULL;
+    memset(&copy->strip, 0, sizeof(copy->strip));
+    copy->writer.buffer = malloc(OUTPUT_BUFFER_SIZE);
+    copy->quant_table_y = malloc(BLOCK_SIZE * BLOCK_SIZE);
+    copy->quant_table_c = malloc(BLOCK_SIZE * BLOCK_SIZE);
+    copy->coef_buffer = aligned_alloc64(blocks * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+    copy->coef_capacity = blocks;
+    rung->sink = spec->sink;
+
+    return copy->writer.buffer && copy->quant_table_y && copy->quant_table_c && copy->coef_buffer ? 0 : -1;
+}
+
+// Release what init_ladder_rung allocated; dct_buffer belongs to the main state
+static void free_ladder_rung(LadderRung *rung)
+{
+    free(rung->state.writer.buffer);
+    free(rung->state.quant_table_y);
+    free(rung->state.quant_table_c);
+    free(rung->state.coef_buffer);
+}
+
+static void encode_ladder_rung(LadderRung *rung, uint32_t total_mcus)
+{
+    JpegState *state = &rung->state;
+    init_writer(&state->writer, rung->sink, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+    set_quality(state, state->quality, total_mcus);
+    write_buffered_image(state, state->coef_buffer, total_mcus);
+    write_jpeg_trailer(state);
+    flush_output(&state->writer);
+    rung->status = state->writer.sink_error ? -1 : 0;
+}
+
+static void *ladder_worker_main(void *arg)
+{
+    LadderJobs *jobs = arg;
+    for (;;)
+    {
+        const int i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+        if (i >= jobs->count)
+            break;
+        encode_ladder_rung(&jobs->rungs[i], jobs->total_mcus);
+    }
+    return NULL;
+}
+
+// Write the main output and every rung of the ladder; the caller ends the
+// main output with its trailer
+static int encode_ladder(JpegState *state, uint32_t total_mcus)
+{
+    if (state->uses_arena)
+        return -1; // Rungs use the heap
+
+    const int count = state->ladder_count;
+    LadderRung *rungs = calloc(count, sizeof(LadderRung));
+    int status = rungs ? 0 : -1;
+    for (int i = 0; i < count && status == 0; i++)
+    {
+        status = init_ladder_rung(&rungs[i], state, &state->ladder[i]);
+    }
+
+    if (status == 0)
+    {
+        LadderJobs jobs = {rungs, count, total_mcus, 0};
+        const int num_workers = state->num_threads - 1 < count ? state->num_threads - 1 : count;
+        pthread_t *threads = num_workers > 0 ? calloc(num_workers, sizeof(pthread_t)) : NULL;
+
+        // If a thread fails to start, the others take its rungs
+        int started = 0;
+        while (threads && started < num_workers &&
+               pthread_create(&threads[started], NULL, ladder_worker_main, &jobs) == 0)
+        {
+            started++;
+        }
+
+        write_main_image(state, total_mcus);
+        ladder_worker_main(&jobs);
+        for (int t = 0; t < started; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        free(threads);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (rungs[i].status != 0)
+                status = -1;
+        }
+    }
+
+    if (rungs)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            free_ladder_rung(&rungs[i]);
+        }
+    }
+    free(rungs);
+    return status;
+}
+
+// Write an image held in the whole-image buffers, and its ladder if any
+static int finish_buffered_image(JpegState *state, uint32_t total_mcus)
+{
+    if (state->ladder_count)
+        return encode_ladder(state, total_mcus);
+
+    write_main_image(state, total_mcus);
+    return 0;
+}
+
+// Encode count extra outputs of every later image, each at its own quality
+// into its own sink, alongside the main output (see encode_ladder). The
+// rungs are not copied and must stay valid; NULL removes the ladder.
+// Arena states refuse ladders, whose rungs need the heap.
+int jpeg_set_ladder(JpegState *state, const JpegRung *rungs, int count)
+{
+    if (!state || count < 0 || (count > 0 && !rungs) || (count > 0 && state->uses_arena))
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (!rungs[i].sink.write)
+            return -1;
+    }
+
+    state->ladder = count > 0 ? rungs : NULL;
+    state->ladder_count = rungs ? count : 0;
+    return 0;
+}
+
+// True if every pixel has R == G == B. Colour images usually fail within
+// the first few pixels, so the scan costs little when it does not pay off.
+static int is_gray_image(const RGB *rgb, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (rgb[i].r != rgb[i].g || rgb[i].g != rgb[i].b)
+            return 0;
+    }
+    return 1;
+}
+
+// Decide the component count of the next encode from gray_mode; gray_source
+// tells whether the input is known to be gray
+static void choose_components(JpegState *state, int gray_source)
+{
+    const int gray = state->gray_mode == GRAY_ON || (state->gray_mode == GRAY_AUTO && gray_source);
+    state->num_components = gray ? 1 : 3;
+}
+
+// Previews are encoded from their planes as scanline images of their own,
+// with the main encode's options, once every block of the main image is
+// transformed
+static int start_scanlines(JpegState *state, JpegSink sink, int gray_source);
+static void encode_strip(JpegState *state, uint32_t row);
+static int end_scanline_image(JpegState *state);
+
+static inline int preview_index(uint8_t scale)
+{
+    return scale == 2 ? 0 : scale == 4 ? 1 : 2;
+}
+
+// Planes for every requested scale, sized for the current encode's layout
+static int alloc_previews(JpegState *state)
+{
+    free_previews(state);
+    if (state->preview_count == 0)
+        return 0;
+    if (state->uses_arena)
+        return -1;
+
+    for (int i = 0; i < state->preview_count; i++)
+    {
+        const int k = preview_index(state->previews[i].scale);
+        if (!state->preview_planes[k])
+            state->preview_planes[k] = malloc(preview_planes_size(state, k));
+        if (!state->preview_planes[k])
+            return -1;
+    }
+    return 0;
+}
+
+// Copy MCU row `row` of preview k into the strip of small, the preview's
+// own state. The planes already hold Y and subsampled Cb/Cr in small's
+// layout, so they skip colour conversion and downsampling; like image
+// rows, they are padded by repeating the last row and column.
+static void load_preview_strip(const JpegState *state, int k, JpegState *small, uint32_t row)
+{
+    StripBuffers *strip = &small->strip;
+    const uint32_t h = mcu_h_factor(small);
+    const uint32_t v = mcu_v_factor(small);
+    const uint32_t mcu_height = mcu_height_of(small);
+    const uint32_t padded = padded_width(small);
+    uint32_t stride;
+
+    const uint8_t *plane = preview_plane(state, k, 0, &stride);
+    for (uint32_t r = 0; r < mcu_height; r++)
+    {
+        const uint32_t y = row * mcu_height + r < small->height ? row * mcu_height + r : small->height - 1;
+        uint8_t *out = strip->plane_y + (size_t)r * strip->stride_y;
+        memcpy(out, plane + (size_t)y * stride, small->width);
+        pad_row(out, small->width, padded);
+    }
+    if (small->num_components == 1)
+        return;
+
+    const uint32_t width_c = (small->width + h - 1) / h;
+    const uint32_t height_c = (small->height + v - 1) / v;
+    for (int c = 1; c < 3; c++)
+    {
+        plane = preview_plane(state, k, c, &stride);
+        for (uint32_t r = 0; r < BLOCK_SIZE; r++)
+        {
+            const uint32_t y = row * BLOCK_SIZE + r < height_c ? row * BLOCK_SIZE + r : height_c - 1;
+            uint8_t *out = (c == 1 ? strip->plane_cb : strip->plane_cr) + (size_t)r * strip->stride_c;
+            memcpy(out, plane + (size_t)y * stride, width_c);
+            pad_row(out, width_c, padded / h);
+        }
+    }
+}
+
+static int write_preview(const JpegState *state, const JpegPreview *preview)
+{
+    const int k = preview_index(preview->scale);
+    const uint32_t width = (state->width + preview->scale - 1) / preview->scale;
+    const uint32_t height = (state->height + preview->scale - 1) / preview->scale;
+    JpegState *small = jpeg_init_scanlines(width, height, state->quality);
+    if (!small)
+        return -1;
+
+    small->dct_method = state->dct_method;
+    small->chroma_layout = state->chroma_layout;
+    small->gray_mode = state->num_components == 1 ? GRAY_ON : GRAY_OFF;
+    small->restart_interval = state->restart_interval;
+    small->optimize_coding = state->optimize_coding;
+    small->progressive = state->progressive;
+    memcpy(small->scan_script, state->scan_script, sizeof(small->scan_script));
+    small->num_scans = state->num_scans;
+
+    int status = start_scanlines(small, preview->sink, 0);
+    const uint32_t mcu_rows = mcu_rows_of(small);
+    for (uint32_t row = 0; row < mcu_rows && status == 0; row++)
+    {
+        load_preview_strip(state, k, small, row);
+        encode_strip(small, row);
+    }
+    if (status == 0)
+        status = end_scanline_image(small);
+    jpeg_cleanup(small);
+    return status;
+}
+
+// Encode and release the previews of the encode that just finished
+static int write_previews(JpegState *state)
+{
+    int status = 0;
+    for (int i = 0; i < state->preview_count; i++)
+    {
+        if (write_preview(state, &state->previews[i]) != 0)
+            status = -1;
+    }
+    free_previews(state);
+    return status;
+}
+
+// Encode count downscaled copies of every later image alongside the main
+// output, each at scale 1/2, 1/4 or 1/8 into its own sink. They are
+// derived from the main encode's DCT blocks (see reduce_mcu), so they cost
+// no resampling pass; they use the main image's quality and options.
+// Transcoding does not produce them. The previews are not copied and must
+// stay valid; NULL removes them. Arena states refuse previews, whose planes
+// need the heap.
+int jpeg_set_previews(JpegState *state, const JpegPreview *previews, int count)
+{
+    if (!state || count < 0 || (count > 0 && !previews) || (count > 0 && state->uses_arena))
+        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t scale = previews[i].scale;
+        if ((scale != 2 && scale != 4 && scale != 8) || !previews[i].sink.write)
+            return -1;
+    }
+
+    state->previews = count > 0 ? previews : NULL;
+    state->preview_count = previews ? count : 0;
+    return 0;
+}
+
+// Main compression function: encode the image held in state into sink.
+// Output passes through a fixed OUTPUT_BUFFER_SIZE buffer that is also
+// flushed after every MCU row, so the sink sees data while encoding runs.
+// With more than one thread, restart segments are encoded concurrently
+// when a restart interval is set, and otherwise MCU rows are analyzed
+// concurrently ahead of a serial entropy coder. Either way the output is
+// the same for any thread count.
+int jpeg_compress_to_sink(JpegState *state, JpegSink sink)
+{
+    if (!state || !sink.write || !state->rgb_data)
+        return -1;
+
+    // Initialize compression state
+    init_writer(&state->writer, sink, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+    choose_components(state, state->gray_mode == GRAY_AUTO &&
+                                 is_gray_image(state->rgb_data, (size_t)state->width * state->height));
+    if (alloc_previews(state) != 0)
+        return -1;
+
+    const uint32_t total_mcus = mcu_cols_of(state) * mcu_rows_of(state);
+    const uint32_t interval = state->restart_interval ? state->restart_interval : total_mcus;
+    const int num_threads = state->uses_arena ? 1 : state->num_threads; // Worker buffers use the heap
+    int status = 0;
+
+    // Optimize, progressive and target size modes transform the whole
+    // image before anything can be written
+    if (buffers_coefficients(state))
+    {
+        if (reserve_image_buffers(state) != 0)
+            return -1;
+        analyze_image(state);
+        status = finish_buffered_image(state, total_mcus);
+    }
+    else if (state->restart_interval > 0 && num_threads > 1 && total_mcus > interval)
+    {
+        write_jpeg_header(state);
+        status = encode_segments_parallel(state, total_mcus);
+    }
+    else if (state->restart_interval == 0 && num_threads > 1 && total_mcus > 1)
+    {
+        write_jpeg_header(state);
+        status = encode_rows_pipelined(state);
+    }
+    else
+    {
+        write_jpeg_header(state);
+
+        // Convert, subsample and encode one MCU-tall strip at a time so
+        // each strip is still in cache when its blocks are transformed
+        state->strip.mcu_row = UINT32_MAX;
+        for (uint32_t first = 0, segment = 0; first < total_mcus; first += interval, segment++)
+        {
+            if (segment > 0)
+                write_marker(state, MARKER_RST0 + ((segment - 1) & 7));
+            encode_segment(state, &state->strip, &state->writer, first,
+                           total_mcus - first < interval ? total_mcus - first : interval);
+        }
+    }
+
+    // Write JPEG trailer
+    write_jpeg_trailer(state);
+    flush_output(&state->writer);
+    if (status == 0 && !state->writer.sink_error)
+        status = write_previews(state);
+
+    return (status != 0 || state->writer.sink_error) ? -1 : 0;
+}
+
+// Encode to a newly created file
+int jpeg_compress(JpegState *state, const char *output_filename)
+{
+    if (!state || !output_filename)
+        return -1;
+
+    // Open output file
+    state->outfile = fopen(output_filename, "wb");
+    if (!state->outfile)
+        return -1;
+
+    int result = jpeg_compress_to_sink(state, jpeg_file_sink(state->outfile));
+    if (fclose(state->outfile) != 0)
+        result = -1;
+    state->outfile = NULL;
+
+    return result;
+}
+
+// Scanline input: rows are pushed as they are produced and, on states from
+// jpeg_init_scanlines, each MCU-tall strip is encoded as soon as it is
+// complete, so only one strip of the image is held at a time. Encoding is
+// then single-threaded. In optimize, progressive and target size modes the
+// strips are transformed into the whole-image buffers instead and the whole image is written by
+// jpeg_finish_scanlines. Other states collect the rows in rgb_data and
+// encode them at the end with jpeg_compress_to_sink, using every thread.
+static void encode_strip(JpegState *state, uint32_t row)
+{
+    const uint32_t mcu_width = mcu_width_of(state);
+    const uint32_t mcus_per_row = mcu_cols_of(state);
+    JpegWriter *writer = &state->writer;
+
+    state->strip.mcu_row = row;
+    if (buffers_coefficients(state))
+    {
+        buffer_strip(state, row);
+        return;
+    }
+
+    const uint32_t interval = state->restart_interval;
+    for (uint32_t col = 0; col < mcus_per_row; col++)
+    {
+        const uint32_t m = row * mcus_per_row + col;
+        if (interval && m > 0 && m % interval == 0)
+        {
+            flush_bits(writer);
+            write_marker(state, MARKER_RST0 + ((m / interval - 1) & 7));
+            memset(writer->last_dc, 0, sizeof(writer->last_dc));
+        }
+        process_mcu(state, &state->strip, writer, col * mcu_width);
+    }
+    flush_output(writer);
+}
+
+// Begin an image of state's current size (see jpeg_reset) into sink
+// Readers that know their source is gray pass gray_source, which lets
+// GRAY_AUTO pick grayscale before any rows arrive; a scanline state cannot
+// look ahead to detect it, so the readers check the rows first. Whole-image
+// states check the pixels at the end.
+static int start_scanlines(JpegState *state, JpegSink sink, int gray_source)
+{
+    if (!state || !sink.write)
+        return -1;
+
+    init_writer(&state->writer, sink, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+    state->next_scanline = 0;
+    state->strip.mcu_row = UINT32_MAX;
+    if (!state->scanline_input)
+        return 0;
+
+    choose_components(state, gray_source);
+    if (alloc_previews(state) != 0)
+        return -1;
+
+    // Whole-image modes write the header once the tables are known
+    if (buffers_coefficients(state))
+        return reserve_image_buffers(state);
+
+    write_jpeg_header(state);
+    return state->writer.sink_error ? -1 : 0;
+}
+
+int jpeg_start_scanlines(JpegState *state, JpegSink sink)
+{
+    return start_scanlines(state, sink, 0);
+}
+
+// Convert and encode up to num_rows rows of interleaved RGB, each width * 3
+// bytes. Returns the number of rows taken, which is less than num_rows only
+// past the bottom of the image, or -1 if the sink failed.
+int jpeg_push_scanlines(JpegState *state, const uint8_t *const *rows, uint32_t num_rows)
+{
+    const uint32_t mcu_height = mcu_height_of(state);
+    const uint32_t remaining = state->height - state->next_scanline;
+    const uint32_t count = num_rows < remaining ? num_rows : remaining;
+
+    if (!state->scanline_input)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            memcpy(&state->rgb_data[(size_t)state->next_scanline++ * state->width], rows[i],
+                   (size_t)state->width * sizeof(RGB));
+        }
+        return (int)count;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint32_t r = state->next_scanline % mcu_height;
+        convert_row(state, &state->strip, rows[i], r);
+        if (++state->next_scanline % mcu_height == 0)
+            encode_strip(state, state->next_scanline / mcu_height - 1);
+    }
+
+    return state->writer.sink_error ? -1 : (int)count;
+}
+
+// Write out a scanline image whose strips have all been encoded
+static int end_scanline_image(JpegState *state)
+{
+    int status = 0;
+    if (buffers_coefficients(state))
+    {
+        status = finish_buffered_image(state, mcu_cols_of(state) * mcu_rows_of(state));
+    }
+    else
+    {
+        flush_bits(&state->writer);
+    }
+
+    write_jpeg_trailer(state);
+    flush_output(&state->writer);
+    if (status == 0 && !state->writer.sink_error)
+        status = write_previews(state);
+    return (status != 0 || state->writer.sink_error) ? -1 : 0;
+}
+
+// Encode the last, partial strip and end the image. Fails if fewer rows
+// than the image height were pushed.
+int jpeg_finish_scanlines(JpegState *state)
+{
+    if (!state || state->next_scanline < state->height)
+        return -1;
+    if (!state->scanline_input)
+        return jpeg_compress_to_sink(state, state->writer.sink);
+
+    const uint32_t mcu_height = mcu_height_of(state);
+    const uint32_t partial = state->height % mcu_height;
+    if (partial)
+    {
+        replicate_strip_rows(state, &state->strip, partial);
+        encode_strip(state, state->height / mcu_height);
+    }
+    return end_scanline_image(state);
+}
+
+// Widen count rows of gray samples, stride bytes apart, to RGB one row at
+// a time and push them
+static int push_gray_rows(JpegState *state, const uint8_t *gray, size_t stride, uint32_t count)
+{
+    if (count == 0)
+        return 0;
+    uint8_t *rgb_row = malloc((size_t)state->width * sizeof(RGB));
+    if (!rgb_row)
+        return -1;
+
+    int status = 0;
+    for (uint32_t i = 0; i < count && status == 0; i++)
+    {
+        const uint8_t *src = gray + i * stride;
+        for (uint32_t x = 0; x < state->width; x++)
+        {
+            rgb_row[x * 3 + 0] = rgb_row[x * 3 + 1] = rgb_row[x * 3 + 2] = src[x];
+        }
+        const uint8_t *rows[1] = {rgb_row};
+        if (jpeg_push_scanlines(state, rows, 1) < 0)
+            status = -1;
+    }
+    free(rgb_row);
+    return status;
+}
+
+// Decode a JPEG with libjpeg and push its rows into state as they are
+// decoded, encoding them into sink. state is resized to the input's
+// dimensions; if it comes from jpeg_init_scanlines the whole image is
+// never held in memory, except as gray rows while GRAY_AUTO waits for a
+// colour one.
+int read_jpeg(const char *filename, JpegState *state, JpegSink sink)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, infile);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(&cinfo);
+
+    const uint32_t width = cinfo.output_width;
+    const int gray_source = cinfo.jpeg_color_space == JCS_GRAYSCALE;
+    int status = jpeg_reset(state, width, cinfo.output_height, state->quality);
+
+    // With GRAY_AUTO a scanline state must choose its components before the
+    // header, so the rows of a colour input are held back, one byte per
+    // pixel, for as long as they are gray. The first colour row starts a
+    // colour image; if none comes, the held rows make a grayscale one. The
+    // buffer grows with the gray rows, so colour photos, which fail in
+    // their first row, never allocate it.
+    uint8_t *held = NULL;
+    uint32_t held_rows = 0;
+    uint32_t held_capacity = 0;
+    int started = 0;
+    if (status == 0 && !(state->gray_mode == GRAY_AUTO && state->scanline_input && !gray_source))
+    {
+        status = start_scanlines(state, sink, gray_source);
+        started = 1;
+    }
+
+    // Hand over rows in the batches libjpeg decodes them in
+    const size_t row_stride = (size_t)width * cinfo.output_components;
+    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride,
+                                                   cinfo.rec_outbuf_height);
+    while (status == 0 && cinfo.output_scanline < cinfo.output_height)
+    {
+        const JDIMENSION rows = jpeg_read_scanlines(&cinfo, buffer, cinfo.rec_outbuf_height);
+        JDIMENSION first = 0;
+        for (; !started && status == 0 && first < rows && is_gray_image((const RGB *)buffer[first], width); first++)
+        {
+            if (held_rows == held_capacity)
+            {
+                uint32_t capacity = held_capacity ? 2 * held_capacity : 16;
+                if (capacity > cinfo.output_height)
+                    capacity = cinfo.output_height;
+                uint8_t *grown = realloc(held, (size_t)capacity * width);
+                if (!grown)
+                {
+                    status = -1;
+                    break;
+                }
+                held = grown;
+                held_capacity = capacity;
+            }
+            uint8_t *luma = held + (size_t)held_rows++ * width;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                luma[x] = buffer[first][x * 3];
+            }
+        }
+        if (status == 0 && !started && first < rows)
+        {
+            started = 1;
+            status = start_scanlines(state, sink, 0);
+            if (status == 0)
+                status = push_gray_rows(state, held, width, held_rows);
+        }
+        if (status == 0 && first < rows &&
+            jpeg_push_scanlines(state, (const uint8_t *const *)buffer + first, rows - first) < 0)
+            status = -1;
+    }
+    if (status == 0 && !started)
+    {
+        status = start_scanlines(state, sink, 1);
+        if (status == 0)
+            status = push_gray_rows(state, held, width, held_rows);
+    }
+    if (status == 0)
+        status = jpeg_finish_scanlines(state);
+
+    if (status == 0)
+        jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(infile);
+    free(held);
+    return status;
+}
+
+// Uncompressed inputs are mapped rather than read, and their rows are
+// pushed to the encoder straight from the mapping
+typedef enum
+{
+    INPUT_JPEG, // Decoded with libjpeg
+    INPUT_PNM,  // Binary PPM (P6) or PGM (P5) with 8-bit samples
+    INPUT_RAW   // Headerless RGB24, size given separately
+} InputFormat;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+} MappedFile;
+
+static int map_file(const char *filename, MappedFile *map)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Could not map file %s\n", filename);
+        return -1;
+    }
+
+    // Rows are read once, front to back
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    map->data = data;
+    map->size = (size_t)st.st_size;
+    return 0;
+}
+
+static void unmap_file(MappedFile *map)
+{
+    munmap((void *)map->data, map->size);
+}
+
+// Encode the width x height image of 1 (gray) or 3 (RGB) interleaved
+// channels at pixels into sink. RGB rows are pushed in place; gray rows are
+// widened to RGB one row at a time, and with GRAY_AUTO select grayscale.
+// So do RGB pixels that are all gray, which scanline states check up front.
+#define PUSH_BATCH_ROWS 16
+
+static int encode_pixel_rows(JpegState *state, JpegSink sink, const uint8_t *pixels,
+                             uint32_t width, uint32_t height, int channels)
+{
+    int gray_source = channels == 1;
+    if (!gray_source && state->gray_mode == GRAY_AUTO && state->scanline_input)
+        gray_source = is_gray_image((const RGB *)pixels, (size_t)width * height);
+    if (jpeg_reset(state, width, height, state->quality) != 0 || start_scanlines(state, sink, gray_source) != 0)
+        return -1;
+
+    const size_t stride = (size_t)width * channels;
+    if (channels == 1)
+        return push_gray_rows(state, pixels, stride, height) == 0 ? jpeg_finish_scanlines(state) : -1;
+
+    int status = 0;
+    for (uint32_t y = 0; y < height && status == 0; y += PUSH_BATCH_ROWS)
+    {
+        const uint32_t count = height - y < PUSH_BATCH_ROWS ? height - y : PUSH_BATCH_ROWS;
+        const uint8_t *rows[PUSH_BATCH_ROWS];
+        for (uint32_t i = 0; i < count; i++)
+        {
+            rows[i] = pixels + (y + i) * stride;
+        }
+        if (jpeg_push_scanlines(state, rows, count) < 0)
+            status = -1;
+    }
+
+    return status == 0 ? jpeg_finish_scanlines(state) : -1;
+}
+
+// Skip whitespace and '#' comments, then parse a decimal header field
+static int parse_pnm_field(const MappedFile *map, size_t *pos, uint32_t *value)
+{
+    for (;;)
+    {
+        while (*pos < map->size && (map->data[*pos] == ' ' || map->data[*pos] == '\t' ||
+                                    map->data[*pos] == '\r' || map->data[*pos] == '\n'))
+            (*pos)++;
+        if (*pos < map->size && map->data[*pos] == '#')
+        {
+            while (*pos < map->size && map->data[*pos] != '\n')
+                (*pos)++;
+            continue;
+        }
+        break;
+    }
+
+    uint64_t number = 0;
+    const size_t start = *pos;
+    while (*pos < map->size && map->data[*pos] >= '0' && map->data[*pos] <= '9' && number <= UINT32_MAX)
+        number = number * 10 + (map->data[(*pos)++] - '0');
+    if (*pos == start || number > UINT32_MAX)
+        return -1;
+
+    *value = (uint32_t)number;
+    return 0;
+}
+
+// Encode a binary PPM or PGM file into sink
+int read_pnm(const char *filename, JpegState *state, JpegSink sink)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return -1;
+
+    uint32_t width, height, maxval;
+    size_t pos = 2;
+    int channels = 0;
+    if (map.size >= 2 && map.data[0] == 'P')
+        channels = map.data[1] == '6' ? 3 : map.data[1] == '5' ? 1 : 0;
+
+    // A single whitespace byte separates the header from the samples
+    int status = -1;
+    if (channels == 0 || parse_pnm_field(&map, &pos, &width) != 0 || parse_pnm_field(&map, &pos, &height) != 0 ||
+        parse_pnm_field(&map, &pos, &maxval) != 0 || pos >= map.size)
+    {
+        fprintf(stderr, "Error: %s is not a binary PPM or PGM file\n", filename);
+    }
+    else if (maxval != 255)
+    {
+        fprintf(stderr, "Error: %s has maximum value %u; only 8-bit (255) files are supported\n", filename, maxval);
+    }
+    else if (width == 0 || height == 0 || (map.size - pos - 1) / channels / width < height)
+    {
+        fprintf(stderr, "Error: %s is truncated\n", filename);
+    }
+    else
+    {
+        status = encode_pixel_rows(state, sink, map.data + pos + 1, width, height, channels);
+    }
+
+    unmap_file(&map);
+    return status;
+}
+
+// Encode a headerless width x height RGB24 file into sink
+int read_raw_rgb(const char *filename, uint32_t width, uint32_t height, JpegState *state, JpegSink sink)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return -1;
+
+    int status = -1;
+    if (width == 0 || height == 0 || map.size / sizeof(RGB) / width < height)
+        fprintf(stderr, "Error: %s holds less than %ux%u RGB pixels\n", filename, width, height);
+    else
+        status = encode_pixel_rows(state, sink, map.data, width, height, 3);
+
+    unmap_file(&map);
+    return status;
+}
+
+// Per-position factors that move coefficients from one quantization
+// table to another, in zigzag order
+typedef struct
+{
+    uint16_t from[BLOCK_SIZE * BLOCK_SIZE];
+    uint16_t to[BLOCK_SIZE * BLOCK_SIZE];
+} Requantizer;
+
+static void init_requantizer(const JQUANT_TBL *source, const uint8_t *target, Requantizer *rq)
+{
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    {
+        rq->from[i] = source->quantval[ZIGZAG_ORDER[i]];
+        rq->to[i] = target[ZIGZAG_ORDER[i]];
+    }
+}
+
+// Dequantize a natural-order block and quantize it again with the target
+// table, rounding to nearest, into zigzag order. Results are clamped to
+// the ranges baseline Huffman coding can represent.
+static void requantize_block(const JCOEF *block, const Requantizer *rq,
+                             int16_t output[BLOCK_SIZE * BLOCK_SIZE])
+{
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    {
+        const int c = block[ZIGZAG_ORDER[i]];
+        if (c == 0 || rq->from[i] == rq->to[i])
+        {
+            output[i] = (int16_t)c;
+            continue;
+        }
+
+        const uint32_t magnitude = ((uint32_t)(c < 0 ? -c : c) * rq->from[i] + rq->to[i] / 2) / rq->to[i];
+        const int limit = i == 0 ? 2047 : 1023;
+        const int value = magnitude > (uint32_t)limit ? limit : (int)magnitude;
+        output[i] = (int16_t)(c < 0 ? -value : value);
+    }
+}
+
+// Transcoding takes the input's blocks as they are, so it is limited to
+// inputs laid out like the encoder's output: 8-bit YCbCr in state's
+// chroma layout, encoded in colour
+static int is_transcodable(const struct jpeg_decompress_struct *cinfo, const JpegState *state)
+{
+    if (cinfo->data_precision != 8 || cinfo->num_components != 3 || cinfo->jpeg_color_space != JCS_YCbCr)
+        return 0;
+    // It always writes three components; grayscale output is decoded
+    if (state->gray_mode != GRAY_OFF)
+        return 0;
+
+    const jpeg_component_info *comp = cinfo->comp_info;
+    return comp[0].h_samp_factor == LAYOUT_H_FACTOR[state->chroma_layout] &&
+           comp[0].v_samp_factor == LAYOUT_V_FACTOR[state->chroma_layout] &&
+           comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1 &&
+           comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1;
+}
+
+// Gather the input's coefficients into the encoder's MCU order,
+// requantized to state's tables
+static void gather_coefficients(struct jpeg_decompress_struct *cinfo, jvirt_barray_ptr *arrays,
+                                const JpegState *state, int16_t *coefs)
+{
+    // The MCU grid of the frame; cinfo's scan fields describe the last
+    // scan, which in progressive files may cover a single component
+    const uint32_t h = mcu_h_factor(state);
+    const uint32_t v = mcu_v_factor(state);
+    const uint32_t mcus_per_row = mcu_cols_of(state);
+    const uint32_t mcu_rows = mcu_rows_of(state);
+    const int blocks_per_mcu = mcu_block_count(state);
+    int16_t (*blocks)[BLOCK_SIZE * BLOCK_SIZE] = (int16_t (*)[BLOCK_SIZE * BLOCK_SIZE])coefs;
+    Requantizer rq[3];
+
+    init_requantizer(cinfo->comp_info[0].quant_table, state->quant_table_y, &rq[0]);
+    init_requantizer(cinfo->comp_info[1].quant_table, state->quant_table_c, &rq[1]);
+    init_requantizer(cinfo->comp_info[2].quant_table, state->quant_table_c, &rq[2]);
+
+    for (uint32_t row = 0; row < mcu_rows; row++)
+    {
+        JBLOCKARRAY luma = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[0], row * v, v, FALSE);
+        JBLOCKARRAY cb = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[1], row, 1, FALSE);
+        JBLOCKARRAY cr = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, arrays[2], row, 1, FALSE);
+
+        for (uint32_t col = 0; col < mcus_per_row; col++, blocks += blocks_per_mcu)
+        {
+            for (uint32_t by = 0; by < v; by++)
+            {
+                for (uint32_t bx = 0; bx < h; bx++)
+                {
+                    requantize_block(luma[by][col * h + bx], &rq[0], blocks[by * h + bx]);
+                }
+            }
+            requantize_block(cb[0][col], &rq[1], blocks[h * v]);
+            requantize_block(cr[0][col], &rq[2], blocks[h * v + 1]);
+        }
+    }
+}
+
+// Re-encode a JPEG at state's quality without decoding it to pixels: the
+// quantized coefficients are read with libjpeg, requantized to state's
+// tables and entropy coded again, skipping the IDCT, colour conversion and
+// forward DCT. The output takes the input's size; state's own image size
+// and pixels are left as they were. Returns 1 without writing anything if
+// the input's layout differs from the encoder's (see is_transcodable), so
+// the caller can decode it instead, and -1 on other errors.
+int jpeg_transcode_to_sink(JpegState *state, FILE *infile, JpegSink sink)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    if (!state || !infile || !sink.write)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
     jpeg_stdio_src(&cinfo, infile);
     jpeg_read_header(&cinfo, TRUE);
 
-    jpeg_start_decompress(&cinfo);
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
-
-    size_t row_stride = cinfo.output_width * cinfo.output_components;
-    RGB *pixels = malloc((*width) * (*height) * sizeof(RGB));
-    if (!pixels)
+    if (!is_transcodable(&cinfo, state))
     {
-        fprintf(stderr, "Error: Memory allocation failed\n");
         jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
-        return NULL;
+        return 1;
     }
 
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
-    for (uint32_t y = 0; y < cinfo.output_height; y++)
+    jvirt_barray_ptr *arrays = jpeg_read_coefficients(&cinfo);
+
+    const uint32_t width = state->width;
+    const uint32_t height = state->height;
+    state->num_components = 3;
+    state->width = cinfo.image_width;
+    state->height = cinfo.image_height;
+
+    const uint32_t total_mcus = mcu_cols_of(state) * mcu_rows_of(state);
+    int16_t *image_coefs = reserve_coef_buffer(state, image_block_count(state));
+    int status = -1;
+    if (image_coefs)
     {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        for (uint32_t x = 0; x < cinfo.output_width; x++)
-        {
-            pixels[y * (*width) + x].r = buffer[0][x * 3 + 0];
-            pixels[y * (*width) + x].g = buffer[0][x * 3 + 1];
-            pixels[y * (*width) + x].b = buffer[0][x * 3 + 2];
-        }
+        gather_coefficients(&cinfo, arrays, state, image_coefs);
+
+        init_writer(&state->writer, sink, state->writer.buffer, OUTPUT_BUFFER_SIZE);
+        write_buffered_image(state, image_coefs, total_mcus);
+        write_jpeg_trailer(state);
+        flush_output(&state->writer);
+        status = state->writer.sink_error ? -1 : 0;
     }
 
+    state->width = width;
+    state->height = height;
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
+    return status;
+}
+
+// Transcode input_filename into a newly created output_filename
+int jpeg_transcode(JpegState *state, const char *input_filename, const char *output_filename)
+{
+    if (!state || !input_filename || !output_filename)
+        return -1;
+
+    FILE *infile = fopen(input_filename, "rb");
+    if (!infile)
+    {
+        fprintf(stderr, "Error: Could not open file %s\n", input_filename);
+        return -1;
+    }
+
+    LazyFileSink output = {output_filename, NULL};
+    JpegSink sink = {lazy_file_sink_write, &output};
+    int result = jpeg_transcode_to_sink(state, infile, sink);
     fclose(infile);
-    return pixels;
+
+    if (output.file && fclose(output.file) != 0)
+        result = -1;
+
+    return result;
+}
+
+// Command line tool. Programs that build the encoder into their own
+// translation unit, like bench.c, define JPEG_NO_MAIN to leave it out.
+#ifndef JPEG_NO_MAIN
+#define MAX_LADDER_OUTPUTS 16 // --ladder options the command line accepts
+#define MAX_PREVIEW_OUTPUTS 3 // --preview options, one per scale
+
+// GRAY_AUTO check: a scanline state, as one thread uses, and a whole-image
+// state with worker threads must choose the same components and write the
+// same file. Each test image is encoded from its pixels, as PNM and raw
+// input are, and from a colour JPEG of them, as JPEG input is. That JPEG
+// is also transcoded: in colour it must stay three components, while the
+// gray modes must make the transcoder decline so the input is decoded.
+#define GRAY_CHECK_WIDTH 37
+#define GRAY_CHECK_HEIGHT 29
+#define GRAY_CHECK_THREADS 4
+
+static int encode_gray_auto(const uint8_t *pixels, const char *jpeg_file, int num_threads, JpegMemoryBuffer *out)
+{
+    JpegState *state = num_threads > 1 ? jpeg_init(1, 1, 90) : jpeg_init_scanlines(1, 1, 90);
+    if (!state)
+        return -1;
+
+    state->gray_mode = GRAY_AUTO;
+    state->num_threads = num_threads;
+    const int status = jpeg_file ? read_jpeg(jpeg_file, state, jpeg_memory_sink(out))
+                                 : encode_pixel_rows(state, jpeg_memory_sink(out), pixels, GRAY_CHECK_WIDTH,
+                                                     GRAY_CHECK_HEIGHT, 3);
+    jpeg_cleanup(state);
+    return status;
+}
+
+// Component count in the SOF0 header, or 0 if there is none
+static int frame_components(const JpegMemoryBuffer *jpeg)
+{
+    for (size_t i = 0; i + 9 < jpeg->size; i++)
+    {
+        if (jpeg->data[i] == 0xFF && jpeg->data[i + 1] == (MARKER_SOF0 & 0xFF))
+            return jpeg->data[i + 9];
+    }
+    return 0;
+}
+
+// Transcode jpeg_file with gray_mode as the command line does, decoding it
+// instead when the transcoder declines. Returns jpeg_transcode_to_sink's
+// result, or -1 if the fallback fails.
+static int transcode_gray(const char *jpeg_file, GrayMode gray_mode, JpegMemoryBuffer *out)
+{
+    JpegState *state = jpeg_init_scanlines(1, 1, 90);
+    FILE *infile = fopen(jpeg_file, "rb");
+    int status = state && infile ? 0 : -1;
+    if (status == 0)
+    {
+        state->gray_mode = gray_mode;
+        status = jpeg_transcode_to_sink(state, infile, jpeg_memory_sink(out));
+        if (status == 1 && read_jpeg(jpeg_file, state, jpeg_memory_sink(out)) != 0)
+            status = -1;
+    }
+    if (infile)
+        fclose(infile);
+    jpeg_cleanup(state);
+    return status;
+}
+
+static int check_gray_auto(void)
+{
+    static const char *modes[] = {"off", "on", "auto"};
+    static const char *images[] = {"gray", "gray with a colour last row", "colour"};
+    static const char *sources[] = {"pixels", "JPEG"};
+    const size_t pixel_count = (size_t)GRAY_CHECK_WIDTH * GRAY_CHECK_HEIGHT;
+    uint8_t pixels[GRAY_CHECK_WIDTH * GRAY_CHECK_HEIGHT * 3];
+    char path[] = "/tmp/jpeg_gray_check_XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not create a temporary file\n");
+        return -1;
+    }
+
+    int failed = 0;
+    for (int image = 0; image < 3; image++)
+    {
+        for (size_t i = 0; i < pixel_count; i++)
+        {
+            const uint8_t v = (uint8_t)(i * 7);
+            const int colour = image == 2 || (image == 1 && i / GRAY_CHECK_WIDTH == GRAY_CHECK_HEIGHT - 1);
+            pixels[i * 3 + 0] = pixels[i * 3 + 2] = v;
+            pixels[i * 3 + 1] = colour ? v ^ 0x55 : v;
+        }
+
+        // Always three components, so only the decoded pixels tell gray
+        JpegState *source = jpeg_init(GRAY_CHECK_WIDTH, GRAY_CHECK_HEIGHT, 100);
+        int status = source && ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0 ? 0 : -1;
+        if (status == 0)
+        {
+            memcpy(source->rgb_data, pixels, sizeof(pixels));
+            status = jpeg_compress_to_sink(source, jpeg_fd_sink(fd));
+        }
+        jpeg_cleanup(source);
+
+        for (int s = 0; s < 2; s++)
+        {
+            JpegMemoryBuffer single = {0}, threaded = {0};
+            const char *jpeg_file = s ? path : NULL;
+            const int encoded = status == 0 && encode_gray_auto(pixels, jpeg_file, 1, &single) == 0 &&
+                                encode_gray_auto(pixels, jpeg_file, GRAY_CHECK_THREADS, &threaded) == 0;
+            const int components = encoded ? frame_components(&single) : 0;
+            const int pass = encoded && components == (image == 0 ? 1 : 3) && single.size == threaded.size &&
+                             memcmp(single.data, threaded.data, single.size) == 0;
+            printf("  %s from %s: %d component%s, 1 and %d threads %s\n", images[image], sources[s], components,
+                   components == 1 ? "" : "s", GRAY_CHECK_THREADS, pass ? "ok" : "FAIL");
+            failed |= !pass;
+            free(single.data);
+            free(threaded.data);
+        }
+
+        for (int mode = GRAY_OFF; mode <= GRAY_AUTO; mode++)
+        {
+            JpegMemoryBuffer out = {0};
+            const int result = status == 0 ? transcode_gray(path, (GrayMode)mode, &out) : -1;
+            const int components = result >= 0 ? frame_components(&out) : 0;
+            const int gray = mode == GRAY_ON || (mode == GRAY_AUTO && image == 0);
+            const int pass = result == (mode == GRAY_OFF ? 0 : 1) && components == (gray ? 1 : 3);
+            printf("  %s transcoded with gray %s: %s, %d component%s %s\n", images[image], modes[mode],
+                   result == 0 ? "transcoded" : "decoded", components, components == 1 ? "" : "s",
+                   pass ? "ok" : "FAIL");
+            failed |= !pass;
+            free(out.data);
+        }
+    }
+
+    close(fd);
+    unlink(path);
+    return failed ? -1 : 0;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    DctMethod dct_method = DCT_INT;
+    int restart_interval = 0;
+    int num_threads = 1;
+    int optimize_coding = 0;
+    int progressive = 0;
+    JpegScan scan_script[MAX_SCANS];
+    int num_scans = 0;
+    int transcode = 0;
+    size_t target_size = 0;
+    LazyFileSink ladder_files[MAX_LADDER_OUTPUTS];
+    JpegRung ladder[MAX_LADDER_OUTPUTS];
+    int ladder_count = 0;
+    LazyFileSink preview_files[MAX_PREVIEW_OUTPUTS];
+    JpegPreview previews[MAX_PREVIEW_OUTPUTS];
+    int preview_count = 0;
+    GrayMode gray_mode = GRAY_OFF;
+    ChromaLayout chroma_layout = CHROMA_420;
+    InputFormat input_format = INPUT_JPEG;
+    uint32_t raw_width = 0, raw_height = 0;
+    const char *positional[3];
+    int positional_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--check-dct") == 0)
+        {
+            static const char *names[] = {"fast", "float", "int"};
+            static const DctMethod methods[] = {DCT_FAST, DCT_FAST_FLOAT, DCT_INT};
+            int status = EXIT_SUCCESS;
+            printf("Kernels: %s\n", select_kernels()->name);
+            for (int m = 0; m < 3; m++)
+            {
+                printf("DCT accuracy (%s) against reference:\n", names[m]);
+                if (check_dct_accuracy(methods[m]) != 0)
+                    status = EXIT_FAILURE;
+            }
+            return status;
+        }
+        else if (strcmp(argv[i], "--check-gray") == 0)
+        {
+            printf("Grayscale output across thread counts and transcoding:\n");
+            return check_gray_auto() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else if (strncmp(argv[i], "--dct=", 6) == 0)
+        {
+            if (parse_dct_method(argv[i] + 6, &dct_method) != 0)
+            {
+                fprintf(stderr, "Error: Unknown DCT method %s (expected ref, fast, float or int)\n", argv[i] + 6);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--optimize") == 0)
+        {
+            optimize_coding = 1;
+        }
+        else if (strcmp(argv[i], "--progressive") == 0)
+        {
+            progressive = 1;
+        }
+        else if (strncmp(argv[i], "--scans=", 8) == 0)
+        {
+            if (parse_scan_script(argv[i] + 8, scan_script, &num_scans) != 0 ||
+                validate_scan_script(scan_script, num_scans) != 0)
+            {
+                fprintf(stderr, "Error: Invalid scan script %s\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            }
+            progressive = 1;
+        }
+        else if (strncmp(argv[i], "--max-size=", 11) == 0)
+        {
+            char *end;
+            const unsigned long long bytes = strtoull(argv[i] + 11, &end, 10);
+            if (end == argv[i] + 11 || *end || bytes == 0)
+            {
+                fprintf(stderr, "Error: Maximum size must be a positive number of bytes\n");
+                return EXIT_FAILURE;
+            }
+            target_size = (size_t)bytes;
+        }
+        else if (strncmp(argv[i], "--ladder=", 9) == 0)
+        {
+            char *end;
+            const long rung_quality = strtol(argv[i] + 9, &end, 10);
+            if (end == argv[i] + 9 || *end != ':' || !end[1] || rung_quality < 1 || rung_quality > 100)
+            {
+                fprintf(stderr, "Error: Ladder outputs are given as QUALITY:PATH with quality 1-100\n");
+                return EXIT_FAILURE;
+            }
+            if (ladder_count == MAX_LADDER_OUTPUTS)
+            {
+                fprintf(stderr, "Error: At most %d ladder outputs\n", MAX_LADDER_OUTPUTS);
+                return EXIT_FAILURE;
+            }
+            ladder_files[ladder_count] = (LazyFileSink){end + 1, NULL};
+            ladder[ladder_count] = (JpegRung){(uint8_t)rung_quality, {lazy_file_sink_write, &ladder_files[ladder_count]}};
+            ladder_count++;
+        }
+        else if (strncmp(argv[i], "--preview=", 10) == 0)
+        {
+            char *end;
+            const long scale = strtol(argv[i] + 10, &end, 10);
+            if (end == argv[i] + 10 || *end != ':' || !end[1] || (scale != 2 && scale != 4 && scale != 8))
+            {
+                fprintf(stderr, "Error: Previews are given as SCALE:PATH with scale 2, 4 or 8\n");
+                return EXIT_FAILURE;
+            }
+            if (preview_count == MAX_PREVIEW_OUTPUTS)
+            {
+                fprintf(stderr, "Error: At most %d previews\n", MAX_PREVIEW_OUTPUTS);
+                return EXIT_FAILURE;
+            }
+            preview_files[preview_count] = (LazyFileSink){end + 1, NULL};
+            previews[preview_count] = (JpegPreview){(uint8_t)scale, {lazy_file_sink_write, &preview_files[preview_count]}};
+            preview_count++;
+        }
+        else if (strcmp(argv[i], "--transcode") == 0)
+        {
+            transcode = 1;
+        }
+        else if (strncmp(argv[i], "--sampling=", 11) == 0)
+        {
+            const char *name = argv[i] + 11;
+            if (strcmp(name, "444") == 0)
+                chroma_layout = CHROMA_444;
+            else if (strcmp(name, "422") == 0)
+                chroma_layout = CHROMA_422;
+            else if (strcmp(name, "420") == 0)
+                chroma_layout = CHROMA_420;
+            else
+            {
+                fprintf(stderr, "Error: Unknown chroma sampling %s (expected 444, 422 or 420)\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--gray") == 0)
+        {
+            gray_mode = GRAY_ON;
+        }
+        else if (strcmp(argv[i], "--gray=auto") == 0)
+        {
+            gray_mode = GRAY_AUTO;
+        }
+        else if (strncmp(argv[i], "--input=", 8) == 0)
+        {
+            const char *name = argv[i] + 8;
+            if (strcmp(name, "jpeg") == 0)
+                input_format = INPUT_JPEG;
+            else if (strcmp(name, "pnm") == 0 || strcmp(name, "ppm") == 0 || strcmp(name, "pgm") == 0)
+                input_format = INPUT_PNM;
+            else if (strcmp(name, "raw") == 0)
+                input_format = INPUT_RAW;
+            else
+            {
+                fprintf(stderr, "Error: Unknown input format %s (expected jpeg, pnm or raw)\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--size=", 7) == 0)
+        {
+            if (sscanf(argv[i] + 7, "%ux%u", &raw_width, &raw_height) != 2 || raw_width == 0 ||
+                raw_height == 0 || raw_width > 65535 || raw_height > 65535)
+            {
+                fprintf(stderr, "Error: Size must be WIDTHxHEIGHT, each 1-65535\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--restart=", 10) == 0)
+        {
+            restart_interval = atoi(argv[i] + 10);
+            if (restart_interval < 0 || restart_interval > 65535)
+            {
+                fprintf(stderr, "Error: Restart interval must be 0-65535 MCUs\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            num_threads = atoi(argv[i] + 10);
+            if (num_threads < 1)
+            {
+                fprintf(stderr, "Error: Thread count must be at least 1\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (positional_count < 3)
+        {
+            positional[positional_count++] = argv[i];
+        }
+        else
+        {
+            positional_count++;
+        }
+    }
+
+    if (positional_count != 3)
     {
-        fprintf(stderr, "Usage: %s <input.jpg> <output.jpg> <quality>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--dct=ref|fast|float|int] [--restart=MCUS] [--threads=N] [--optimize]\n"
+                        "       [--progressive] [--scans=SCRIPT] [--max-size=BYTES] [--ladder=QUALITY:PATH]... [--preview=SCALE:PATH]...\n"
+                        "       [--sampling=444|422|420] [--gray[=auto]] [--transcode] [--input=jpeg|pnm|raw] [--size=WxH] <input> <output.jpg> <quality>\n",
+                argv[0]);
+        fprintf(stderr, "       %s --check-dct\n", argv[0]);
+        fprintf(stderr, "       %s --check-gray\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    const char *input_filename = argv[1];
-    const char *output_filename = argv[2];
-    uint8_t quality = (uint8_t)atoi(argv[3]);
+    const char *input_filename = positional[0];
+    const char *output_filename = positional[1];
+    uint8_t quality = (uint8_t)atoi(positional[2]);
 
-    uint32_t width, height;
-    RGB *rgb_data = read_jpeg(input_filename, &width, &height);
-    if (!rgb_data)
+    if (input_format == INPUT_RAW && raw_width == 0)
     {
+        fprintf(stderr, "Error: Raw input needs --size=WIDTHxHEIGHT\n");
         return EXIT_FAILURE;
     }
 
-    // Initialize JPEG state
-    JpegState *jpeg_state = jpeg_init(width, height, quality);
+    // The input sets the image size. A single thread encodes strips as they
+    // are decoded; worker threads need the whole image.
+    JpegState *jpeg_state = num_threads > 1 ? jpeg_init(1, 1, quality) : jpeg_init_scanlines(1, 1, quality);
     if (!jpeg_state)
     {
         fprintf(stderr, "Error: Failed to initialize JPEG state\n");
-        free(rgb_data);
         return EXIT_FAILURE;
     }
 
-    jpeg_state->rgb_data = rgb_data;
+    jpeg_state->dct_method = dct_method;
+    jpeg_state->restart_interval = (uint16_t)restart_interval;
+    jpeg_state->num_threads = num_threads;
+    jpeg_state->optimize_coding = optimize_coding;
+    jpeg_state->progressive = progressive;
+    jpeg_state->target_size = target_size;
+    jpeg_set_ladder(jpeg_state, ladder, ladder_count);
+    jpeg_set_previews(jpeg_state, previews, preview_count);
+    if (num_scans > 0)
+        jpeg_set_scan_script(jpeg_state, scan_script, num_scans);
+    jpeg_state->gray_mode = gray_mode;
+    jpeg_state->chroma_layout = chroma_layout;
+
+    // Requantize the input's coefficients directly when its layout allows;
+    // fitting a size, ladders and previews need the unquantized coefficients
+    if (transcode && input_format == INPUT_JPEG && !target_size && !ladder_count && !preview_count)
+    {
+        const int result = jpeg_transcode(jpeg_state, input_filename, output_filename);
+        if (result < 0)
+        {
+            fprintf(stderr, "Error: JPEG transcoding failed\n");
+            jpeg_cleanup(jpeg_state);
+            return EXIT_FAILURE;
+        }
+        if (result == 0)
+        {
+            printf("JPEG transcoding successful: %s\n", output_filename);
+            jpeg_cleanup(jpeg_state);
+            return EXIT_SUCCESS;
+        }
+        fprintf(stderr, "Note: %s does not match the output's chroma layout or colour, decoding it instead\n",
+                input_filename);
+    }
 
     // Perform JPEG compression
-    if (jpeg_compress(jpeg_state, output_filename) != 0)
+    LazyFileSink output = {output_filename, NULL};
+    JpegSink sink = {lazy_file_sink_write, &output};
+    int result;
+    if (input_format == INPUT_PNM)
+        result = read_pnm(input_filename, jpeg_state, sink);
+    else if (input_format == INPUT_RAW)
+        result = read_raw_rgb(input_filename, raw_width, raw_height, jpeg_state, sink);
+    else
+        result = read_jpeg(input_filename, jpeg_state, sink);
+    const long output_size = output.file ? ftell(output.file) : 0;
+    if (output.file && fclose(output.file) != 0)
+        result = -1;
+    for (int i = 0; i < ladder_count; i++)
+    {
+        if (!ladder_files[i].file || fclose(ladder_files[i].file) != 0)
+            result = -1;
+    }
+    for (int i = 0; i < preview_count; i++)
+    {
+        if (!preview_files[i].file || fclose(preview_files[i].file) != 0)
+            result = -1;
+    }
+    const uint8_t fitted_quality = jpeg_state->fitted_quality;
+    jpeg_cleanup(jpeg_state);
+
+    if (result != 0)
     {
         fprintf(stderr, "Error: JPEG compression failed\n");
-        jpeg_cleanup(jpeg_state);
-        free(rgb_data);
         return EXIT_FAILURE;
     }
 
-    printf("JPEG compression successful: %s\n", output_filename);
+    for (int i = 0; i < ladder_count; i++)
+    {
+        printf("JPEG compression successful: %s (quality %d)\n", ladder_files[i].filename, ladder[i].quality);
+    }
+    for (int i = 0; i < preview_count; i++)
+    {
+        printf("JPEG compression successful: %s (1/%d scale)\n", preview_files[i].filename, previews[i].scale);
+    }
 
-    // Clean up
-    jpeg_cleanup(jpeg_state);
-    free(rgb_data);
+    if (target_size)
+    {
+        printf("JPEG compression successful: %s (quality %d, %ld bytes)\n", output_filename, fitted_quality,
+               output_size);
+        if ((size_t)output_size > target_size)
+            fprintf(stderr, "Note: %s is larger than %zu bytes even at quality 1\n", output_filename, target_size);
+        return EXIT_SUCCESS;
+    }
 
+    printf("JPEG compression successful: %s\n", output_filename);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif // JPEG_NO_MAIN